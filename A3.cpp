@@ -1,34 +1,291 @@
 #include <gtk/gtk.h>
+#include <glib-unix.h>
 #include <vector>
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <cmath>
 #include <thread>
 #include <chrono>
 #include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <set>
+#include <memory>
 #include <string>
 #include <cairo.h>
 #include <iomanip>
+#include "kmeans_core.h"
+#include <limits>
+#include <random>
+#include <cstring>
+#include <cstdlib>
+#include <cstdarg>
+#include <charconv>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <semaphore.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <cerrno>
+#include <ctime>
+#include <csignal>
+#include <cstddef>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 // Forward declarations
-void print_iteration(int iteration);
+void sync_point_columns();
+void close_mapped_points();
+void mark_points_changed();
+void hamerly_reset();
 static void on_pause_clicked(GtkWidget* widget, gpointer data);
 static void on_step_clicked(GtkWidget* widget, gpointer data);
 static void on_back_clicked(GtkWidget* widget, gpointer data);
 static void on_speed_changed(GtkRange* range, gpointer user_data);
+static void on_max_speed_toggled(GtkCheckButton* button, gpointer data);
+static gboolean on_frame_tick(GtkWidget* widget, GdkFrameClock* clock, gpointer data);
+static void on_overlay_toggled(GtkCheckButton* button, gpointer data);
 static void on_restart_clicked(GtkWidget* widget, gpointer data);
 
-struct Point {
-    double x, y;
-    int cluster = -1;
+// The visualizer works on the 2-D double instantiation of the shared core types.
+using Point = kmeans::Point<2, double>;
+using Centroid = kmeans::Centroid<2, double>;
+
+struct Color {
+    double r, g, b;
 };
 
-struct Centroid {
-    double x, y;
+static void append_bytes(std::vector<uint8_t>& out, const void* data, size_t length) {
+    const uint8_t* p = (const uint8_t*)data;
+    out.insert(out.end(), p, p + length);
+}
+
+// Bounds-checked sequential reads from a byte range.
+struct ByteReader {
+    const uint8_t* p;
+    const uint8_t* end;
+
+    size_t remaining() const { return end - p; }
+
+    bool read(void* out, size_t length) {
+        if (remaining() < length) return false;
+        memcpy(out, p, length);
+        p += length;
+        return true;
+    }
 };
 
-struct Color {
-    double r, g, b;
+// Iteration history for Back/Forward stepping. Coordinates never change
+// during a run, so only cluster labels are kept: every SNAPSHOT_INTERVAL-th
+// entry (or whenever most labels changed) holds the full label array packed
+// to 1, 2 or 4 bytes per point depending on K; the others hold just the points
+// that were reassigned since the previous entry. Restoring replays at most
+// one snapshot interval of deltas.
+class HistoryStore {
+public:
+    size_t snapshot_interval = 16;
+
+    void clear() {
+        entries.clear();
+        last_labels.clear();
+        stored_bytes = 0;
+    }
+
+    size_t size() const { return entries.size(); }
+    size_t bytes() const { return stored_bytes; }
+
+    void push(const std::vector<Point>& pts, const std::vector<Centroid>& cents) {
+        if (!entries.empty() && (pts.size() != last_labels.size() || cents.size() != num_centroids)) {
+            clear();
+        }
+        if (entries.empty()) {
+            num_centroids = cents.size();
+            label_width = num_centroids <= 0xff ? 1 : num_centroids <= 0xffff ? 2 : 4;
+            last_labels.assign(pts.size(), -1);
+        }
+
+        Entry entry;
+        entry.centroids = cents;
+
+        for (size_t i = 0; i < pts.size(); ++i) {
+            if (pts[i].cluster != last_labels[i]) {
+                entry.changed_index.push_back(i);
+                entry.changed_label.push_back(pts[i].cluster);
+                last_labels[i] = pts[i].cluster;
+            }
+        }
+
+        const size_t delta_bytes = entry.changed_index.size() * (sizeof(uint32_t) + sizeof(int32_t));
+        const size_t full_bytes = pts.size() * label_width;
+        if (entries.size() % snapshot_interval == 0 || delta_bytes >= full_bytes) {
+            entry.snapshot = true;
+            std::vector<uint32_t>().swap(entry.changed_index);
+            std::vector<int32_t>().swap(entry.changed_label);
+            entry.labels.resize(full_bytes);
+            for (size_t i = 0; i < pts.size(); ++i) {
+                store_label(entry.labels.data(), i, last_labels[i]);
+            }
+        }
+
+        stored_bytes += entry.labels.size() + entry.changed_index.size() * sizeof(uint32_t) +
+                        entry.changed_label.size() * sizeof(int32_t) + cents.size() * sizeof(Centroid);
+        entries.push_back(std::move(entry));
+    }
+
+    // Rewrites the cluster labels in pts and the centroids to entry index.
+    void restore(size_t index, std::vector<Point>& pts, std::vector<Centroid>& cents) const {
+        if (index >= entries.size() || pts.size() != last_labels.size()) return;
+
+        size_t base = index;
+        while (!entries[base].snapshot) base--;
+
+        const Entry& snapshot = entries[base];
+        for (size_t i = 0; i < pts.size(); ++i) {
+            pts[i].cluster = load_label(snapshot.labels.data(), i);
+        }
+        for (size_t e = base + 1; e <= index; ++e) {
+            const Entry& delta = entries[e];
+            for (size_t j = 0; j < delta.changed_index.size(); ++j) {
+                pts[delta.changed_index[j]].cluster = delta.changed_label[j];
+            }
+        }
+        cents = entries[index].centroids;
+    }
+
+    // Appends the whole store to out; read back with deserialize().
+    void serialize(std::vector<uint8_t>& out) const {
+        const uint64_t head[5] = { entries.size(), last_labels.size(), num_centroids, label_width, stored_bytes };
+        append_bytes(out, head, sizeof(head));
+        append_bytes(out, last_labels.data(), last_labels.size() * sizeof(int));
+        for (const Entry& entry : entries) {
+            const uint64_t sizes[4] = { entry.snapshot, entry.labels.size(), entry.changed_index.size(), entry.centroids.size() };
+            append_bytes(out, sizes, sizeof(sizes));
+            append_bytes(out, entry.labels.data(), entry.labels.size());
+            append_bytes(out, entry.changed_index.data(), entry.changed_index.size() * sizeof(uint32_t));
+            append_bytes(out, entry.changed_label.data(), entry.changed_label.size() * sizeof(int32_t));
+            append_bytes(out, entry.centroids.data(), entry.centroids.size() * sizeof(Centroid));
+        }
+    }
+
+    // Every count is checked against the bytes left before anything is
+    // allocated, and labels and point indices against the stored sizes, so a
+    // damaged store is rejected rather than replayed.
+    bool deserialize(const uint8_t* data, size_t length) {
+        ByteReader in{ data, data + length };
+        uint64_t head[5];
+        clear();
+        if (!in.read(head, sizeof(head)) || head[1] > in.remaining() / sizeof(int) ||
+            (head[3] != 1 && head[3] != 2 && head[3] != 4)) {
+            return false;
+        }
+        last_labels.resize(head[1]);
+        num_centroids = head[2];
+        label_width = head[3];
+        stored_bytes = head[4];
+        if (!in.read(last_labels.data(), last_labels.size() * sizeof(int)) ||
+            !valid_labels(last_labels) || head[0] > in.remaining() / (4 * sizeof(uint64_t))) {
+            clear();
+            return false;
+        }
+
+        entries.resize(head[0]);
+        for (Entry& entry : entries) {
+            uint64_t sizes[4];
+            if (!in.read(sizes, sizeof(sizes)) || sizes[1] > in.remaining() ||
+                sizes[2] > in.remaining() / (sizeof(uint32_t) + sizeof(int32_t)) ||
+                sizes[3] > in.remaining() / sizeof(Centroid)) {
+                clear();
+                return false;
+            }
+            entry.snapshot = sizes[0] != 0;
+            entry.labels.resize(sizes[1]);
+            entry.changed_index.resize(sizes[2]);
+            entry.changed_label.resize(sizes[2]);
+            entry.centroids.resize(sizes[3]);
+            if (!in.read(entry.labels.data(), entry.labels.size()) ||
+                !in.read(entry.changed_index.data(), entry.changed_index.size() * sizeof(uint32_t)) ||
+                !in.read(entry.changed_label.data(), entry.changed_label.size() * sizeof(int32_t)) ||
+                !in.read(entry.centroids.data(), entry.centroids.size() * sizeof(Centroid)) ||
+                !valid_entry(entry, &entry == &entries.front())) {
+                clear();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // True when the store is empty or was recorded for num_points points and k centroids.
+    bool matches(size_t num_points, size_t k) const {
+        return entries.empty() || (last_labels.size() == num_points && num_centroids == k);
+    }
+
+private:
+    struct Entry {
+        bool snapshot = false;
+        std::vector<uint8_t> labels;           // snapshot: packed label + 1 per point
+        std::vector<uint32_t> changed_index;   // delta: reassigned points
+        std::vector<int32_t> changed_label;
+        std::vector<Centroid> centroids;
+    };
+
+    void store_label(uint8_t* data, size_t i, int label) const {
+        uint32_t value = (uint32_t)(label + 1);
+        switch (label_width) {
+            case 1: data[i] = (uint8_t)value; break;
+            case 2: { uint16_t v = value; memcpy(data + 2 * i, &v, 2); break; }
+            default: memcpy(data + 4 * i, &value, 4); break;
+        }
+    }
+
+    int load_label(const uint8_t* data, size_t i) const {
+        switch (label_width) {
+            case 1: return (int)data[i] - 1;
+            case 2: { uint16_t v; memcpy(&v, data + 2 * i, 2); return (int)v - 1; }
+            default: { uint32_t v; memcpy(&v, data + 4 * i, 4); return (int)v - 1; }
+        }
+    }
+
+    bool valid_label(int64_t label) const {
+        return label >= -1 && label < (int64_t)num_centroids;
+    }
+
+    bool valid_labels(const std::vector<int>& labels) const {
+        for (int label : labels) {
+            if (!valid_label(label)) return false;
+        }
+        return true;
+    }
+
+    // The first entry must be a snapshot so restore() always finds a base.
+    bool valid_entry(const Entry& entry, bool first) const {
+        const size_t n = last_labels.size();
+        if (entry.centroids.size() != num_centroids) return false;
+        if (entry.snapshot) {
+            if (entry.labels.size() != n * label_width || !entry.changed_index.empty()) return false;
+            for (size_t i = 0; i < n; ++i) {
+                if (!valid_label(load_label(entry.labels.data(), i))) return false;
+            }
+            return true;
+        }
+        if (first || !entry.labels.empty()) return false;
+        for (size_t j = 0; j < entry.changed_index.size(); ++j) {
+            if (entry.changed_index[j] >= n || !valid_label(entry.changed_label[j])) return false;
+        }
+        return true;
+    }
+
+    std::vector<Entry> entries;
+    std::vector<int> last_labels;   // labels as of the newest entry
+    size_t num_centroids = 0;
+    size_t label_width = 1;
+    size_t stored_bytes = 0;
 };
 
 // Global variables
@@ -37,9 +294,95 @@ std::vector<Centroid> centroids;
 std::atomic<int> current_iteration(1);
 std::atomic<bool> is_paused(false);
 std::atomic<bool> step_requested(false);
-std::vector<std::vector<Centroid>> centroid_history;
-std::vector<std::vector<Point>> point_history;
+std::atomic<bool> back_requested(false);
+std::atomic<bool> max_speed(false);        // iterate without the per-iteration delay
+std::atomic<bool> show_overlay(false);     // profiling overlay in on_draw
+std::mutex run_mutex;                      // guards the run_wakeup wait only
+std::condition_variable run_wakeup;
+HistoryStore history;
 std::atomic<int> iteration_speed(2000); // Default speed in milliseconds
+std::atomic<uint64_t> points_version(0); // bumped whenever positions or labels change
+
+// Command line options understood by A3. Anything not listed here is left in
+// argv for GTK.
+struct Options {
+    std::string kernel = "auto";
+    unsigned threads = 0;       // 0 = serial iteration, otherwise size of the worker pool
+    std::string prune = "none";
+    std::string index = "auto";
+    std::string precision = "double";
+    bool bench_assign = false;
+    size_t bench_points = 2000000;
+    size_t bench_centroids = 16;
+    int bench_repeats = 5;
+    std::string input = "data3.txt";
+    size_t minibatch = 0;       // points per batch; 0 = full-batch Lloyd iterations
+    int epochs = 1;
+    bool compare_full = false;
+    bool headless = false;
+    bool max_speed = false;     // start the GUI in max-speed mode
+    bool overlay = false;       // start with the profiling overlay shown
+    std::string profile;        // per-iteration JSON lines go here
+    std::string log;            // empty = summary in the GUI, off headless
+    std::string log_file;       // "-" = stdout; empty = stdout in the GUI, stderr headless
+    size_t log_sample = 1000;
+    int max_iterations = 1000;  // headless only; the GUI runs until convergence
+    bool history = false;       // keep per-iteration history in headless mode
+    size_t generate_points = 0; // > 0 replaces the input file with Gaussian blobs
+    size_t generate_centroids = 8;
+    uint64_t seed = 1;
+    std::string write_data;
+    size_t snapshot_interval = 16;
+    std::string init = "file";
+    size_t k = 0;               // centroid count for --init seeding; 0 = as loaded
+    std::string empty = "keep";
+    size_t sweep_min = 0, sweep_max = 0, sweep_step = 1;   // --sweep; sweep_min > 0 enables it
+    int restarts = 3;
+    size_t silhouette_sample = 2000;
+    size_t shards = 0;          // > 0 runs headless with this many worker processes
+    size_t shard_scaling = 0;   // > 0 runs 1, 2, 4, ... this many workers and reports scaling
+    std::string transport = "socket";
+    std::string checkpoint;     // --checkpoint=PATH; empty = no checkpoints
+    int checkpoint_every = 0;   // iterations between checkpoints; 0 = on signal only
+    std::string resume;         // checkpoint to continue from
+    std::string update = "full";
+    int resum_interval = 32;    // incremental update: full re-sum every N iterations
+    bool compare_init = false;
+    size_t dim = 2;             // dimension of --generate data; != 2 uses the generic core
+    uint32_t dtype = 0;         // POINT_DTYPE_* of --generate data
+    std::string convert_input, convert_output;
+    uint32_t convert_dtype = 0;
+};
+
+Options options;
+
+// Structure-of-arrays mirror of the point coordinates used by the assignment engine.
+// column_x/column_y point either into point_columns or straight into a mapped
+// binary point file. Both are planar (all x, then all y), so column_y is always
+// column_x + column_size and the generic core can read the columns as they are.
+std::vector<double> point_columns;
+const double* column_x = nullptr;
+const double* column_y = nullptr;
+size_t column_size = 0;
+
+kmeans::PlanarPoints<2, double> point_view() {
+    kmeans::PlanarPoints<2, double> view;
+    view.base = column_x;
+    view.count = column_size;
+    return view;
+}
+
+struct MappedPoints {
+    void* base = nullptr;
+    size_t length = 0;
+    const double* xs = nullptr;  // planar: count x values, then count y values
+    size_t count = 0;
+};
+
+MappedPoints mapped_points;
+std::vector<double> centroid_xs, centroid_ys;
+std::vector<float> reduced_xs, reduced_ys;   // float32 point columns for --precision=mixed
+std::vector<int> nearest_cluster;
 
 Color get_distinct_color(int index, int total) {
     Color color;
@@ -75,156 +418,4207 @@ Color get_distinct_color(int index, int total) {
     return color;
 }
 
-// Button callbacks
+// Wakes run_kmeans after a control flag changed. Taking the mutex orders the
+// flag write before the wait's predicate check, so the wakeup cannot be lost.
+void wake_kmeans_thread() {
+    std::lock_guard<std::mutex> lock(run_mutex);
+    run_wakeup.notify_one();
+}
+
+// Button callbacks. data is the drawing area for callbacks that change the
+// status line.
 static void on_pause_clicked(GtkWidget* widget, gpointer data) {
     is_paused = !is_paused;
     const char* label = is_paused ? "Resume" : "Pause";
     gtk_button_set_label(GTK_BUTTON(widget), label);
+    wake_kmeans_thread();
+    gtk_widget_queue_draw(GTK_WIDGET(data));
 }
 
 static void on_step_clicked(GtkWidget* widget, gpointer data) {
     if (is_paused) {
         step_requested = true;
+        wake_kmeans_thread();
+    }
+}
+
+// The restore itself runs on the k-means thread (see run_kmeans) so the
+// clustering state only ever has one writer.
+static void on_back_clicked(GtkWidget* widget, gpointer data) {
+    if (is_paused) {
+        back_requested = true;
+        wake_kmeans_thread();
+    }
+}
+
+static void on_speed_changed(GtkRange* range, gpointer user_data) {
+    iteration_speed = gtk_range_get_value(range);
+    wake_kmeans_thread();
+    gtk_widget_queue_draw(GTK_WIDGET(user_data));
+}
+
+static void on_max_speed_toggled(GtkCheckButton* button, gpointer data) {
+    max_speed = gtk_check_button_get_active(button);
+    wake_kmeans_thread();
+    gtk_widget_queue_draw(GTK_WIDGET(data));
+}
+
+static void on_overlay_toggled(GtkCheckButton* button, gpointer data) {
+    show_overlay = gtk_check_button_get_active(button);
+    gtk_widget_queue_draw(GTK_WIDGET(data));
+}
+
+
+
+double calculate_distance(const Point& p, const Centroid& c) {
+    return std::sqrt(std::pow(p.x - c.x, 2) + std::pow(p.y - c.y, 2));
+}
+
+// ---- Assignment engine ----
+// The nearest-centroid scan works on contiguous x/y columns and computes each
+// squared distance exactly as the sum inside calculate_distance. Two distinct
+// squared distances can round to the same root, and the old loop then keeps the
+// lower index, so the kernels also take the root (one pipelined sqrt per
+// distance) and compare roots strictly. Every kernel gives exactly the
+// assignment of the old loop.
+
+enum class AssignKernel { Reference, Scalar, SSE2, AVX2 };
+
+AssignKernel assign_kernel = AssignKernel::Scalar;
+
+const char* assign_kernel_name(AssignKernel kernel) {
+    switch (kernel) {
+        case AssignKernel::Reference: return "reference";
+        case AssignKernel::Scalar: return "scalar";
+        case AssignKernel::SSE2: return "sse2";
+        case AssignKernel::AVX2: return "avx2";
+    }
+    return "unknown";
+}
+
+bool assign_kernel_supported(AssignKernel kernel) {
+    switch (kernel) {
+        case AssignKernel::Reference:
+        case AssignKernel::Scalar:
+            return true;
+#if defined(__x86_64__) || defined(__i386__)
+        case AssignKernel::SSE2:
+            return __builtin_cpu_supports("sse2");
+        case AssignKernel::AVX2:
+            return __builtin_cpu_supports("avx2");
+#else
+        default:
+            return false;
+#endif
+    }
+    return false;
+}
+
+AssignKernel detect_assign_kernel() {
+    if (assign_kernel_supported(AssignKernel::AVX2)) return AssignKernel::AVX2;
+    if (assign_kernel_supported(AssignKernel::SSE2)) return AssignKernel::SSE2;
+    return AssignKernel::Scalar;
+}
+
+void use_point_columns(const double* xs, size_t count) {
+    column_x = xs;
+    column_y = xs + count;
+    column_size = count;
+    reduced_xs.clear();
+    reduced_ys.clear();
+    hamerly_reset();
+    mark_points_changed();
+}
+
+void sync_point_columns() {
+    if (mapped_points.xs && mapped_points.count == points.size()) {
+        use_point_columns(mapped_points.xs, mapped_points.count);
+        return;
+    }
+    const size_t n = points.size();
+    point_columns.resize(2 * n);
+    for (size_t i = 0; i < n; ++i) {
+        point_columns[i] = points[i].x;
+        point_columns[n + i] = points[i].y;
+    }
+    use_point_columns(point_columns.data(), n);
+}
+
+void sync_centroid_columns() {
+    centroid_xs.resize(centroids.size());
+    centroid_ys.resize(centroids.size());
+    for (size_t i = 0; i < centroids.size(); ++i) {
+        centroid_xs[i] = centroids[i].x;
+        centroid_ys[i] = centroids[i].y;
+    }
+}
+
+// Centroids as a row-major core model.
+kmeans::Model<2, double> centroid_model(const std::vector<Centroid>& from) {
+    kmeans::Model<2, double> model;
+    model.k = from.size();
+    model.centroids.reserve(2 * model.k);
+    for (const auto& c : from) {
+        model.centroids.push_back(c.x);
+        model.centroids.push_back(c.y);
+    }
+    return model;
+}
+
+static void assign_scalar(const double* xs, const double* ys, size_t n,
+                          const double* cx, const double* cy, size_t k, int* out) {
+    for (size_t i = 0; i < n; ++i) {
+        int closest_cluster = -1;
+        double min_distance = std::numeric_limits<double>::max();
+        for (size_t c = 0; c < k; ++c) {
+            double dx = xs[i] - cx[c];
+            double dy = ys[i] - cy[c];
+            double distance = std::sqrt(dx * dx + dy * dy);
+            if (distance < min_distance) {
+                min_distance = distance;
+                closest_cluster = c;
+            }
+        }
+        out[i] = closest_cluster;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Two independent vectors per pass so the compare/select chains overlap.
+static void assign_sse2(const double* xs, const double* ys, size_t n,
+                        const double* cx, const double* cy, size_t k, int* out) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128d px0 = _mm_loadu_pd(xs + i), px1 = _mm_loadu_pd(xs + i + 2);
+        __m128d py0 = _mm_loadu_pd(ys + i), py1 = _mm_loadu_pd(ys + i + 2);
+        __m128d best0 = _mm_set1_pd(std::numeric_limits<double>::max()), best1 = best0;
+        __m128d idx0 = _mm_set1_pd(-1.0), idx1 = idx0;
+
+        for (size_t c = 0; c < k; ++c) {
+            __m128d ccx = _mm_set1_pd(cx[c]);
+            __m128d ccy = _mm_set1_pd(cy[c]);
+            __m128d cidx = _mm_set1_pd((double)c);
+
+            __m128d dx0 = _mm_sub_pd(px0, ccx), dy0 = _mm_sub_pd(py0, ccy);
+            __m128d dx1 = _mm_sub_pd(px1, ccx), dy1 = _mm_sub_pd(py1, ccy);
+            __m128d d0 = _mm_sqrt_pd(_mm_add_pd(_mm_mul_pd(dx0, dx0), _mm_mul_pd(dy0, dy0)));
+            __m128d d1 = _mm_sqrt_pd(_mm_add_pd(_mm_mul_pd(dx1, dx1), _mm_mul_pd(dy1, dy1)));
+
+            __m128d lt0 = _mm_cmplt_pd(d0, best0);
+            __m128d lt1 = _mm_cmplt_pd(d1, best1);
+            best0 = _mm_or_pd(_mm_and_pd(lt0, d0), _mm_andnot_pd(lt0, best0));
+            best1 = _mm_or_pd(_mm_and_pd(lt1, d1), _mm_andnot_pd(lt1, best1));
+            idx0 = _mm_or_pd(_mm_and_pd(lt0, cidx), _mm_andnot_pd(lt0, idx0));
+            idx1 = _mm_or_pd(_mm_and_pd(lt1, cidx), _mm_andnot_pd(lt1, idx1));
+        }
+
+        out[i] = _mm_cvtsd_si32(idx0);
+        out[i + 1] = _mm_cvtsd_si32(_mm_unpackhi_pd(idx0, idx0));
+        out[i + 2] = _mm_cvtsd_si32(idx1);
+        out[i + 3] = _mm_cvtsd_si32(_mm_unpackhi_pd(idx1, idx1));
+    }
+    assign_scalar(xs + i, ys + i, n - i, cx, cy, k, out + i);
+}
+
+__attribute__((target("avx2")))
+static void assign_avx2(const double* xs, const double* ys, size_t n,
+                        const double* cx, const double* cy, size_t k, int* out) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256d px0 = _mm256_loadu_pd(xs + i), px1 = _mm256_loadu_pd(xs + i + 4);
+        __m256d py0 = _mm256_loadu_pd(ys + i), py1 = _mm256_loadu_pd(ys + i + 4);
+        __m256d best0 = _mm256_set1_pd(std::numeric_limits<double>::max()), best1 = best0;
+        __m256d idx0 = _mm256_set1_pd(-1.0), idx1 = idx0;
+
+        for (size_t c = 0; c < k; ++c) {
+            __m256d ccx = _mm256_set1_pd(cx[c]);
+            __m256d ccy = _mm256_set1_pd(cy[c]);
+            __m256d cidx = _mm256_set1_pd((double)c);
+
+            __m256d dx0 = _mm256_sub_pd(px0, ccx), dy0 = _mm256_sub_pd(py0, ccy);
+            __m256d dx1 = _mm256_sub_pd(px1, ccx), dy1 = _mm256_sub_pd(py1, ccy);
+            __m256d d0 = _mm256_sqrt_pd(_mm256_add_pd(_mm256_mul_pd(dx0, dx0), _mm256_mul_pd(dy0, dy0)));
+            __m256d d1 = _mm256_sqrt_pd(_mm256_add_pd(_mm256_mul_pd(dx1, dx1), _mm256_mul_pd(dy1, dy1)));
+
+            __m256d lt0 = _mm256_cmp_pd(d0, best0, _CMP_LT_OQ);
+            __m256d lt1 = _mm256_cmp_pd(d1, best1, _CMP_LT_OQ);
+            best0 = _mm256_blendv_pd(best0, d0, lt0);
+            best1 = _mm256_blendv_pd(best1, d1, lt1);
+            idx0 = _mm256_blendv_pd(idx0, cidx, lt0);
+            idx1 = _mm256_blendv_pd(idx1, cidx, lt1);
+        }
+
+        _mm_storeu_si128((__m128i*)(out + i), _mm256_cvtpd_epi32(idx0));
+        _mm_storeu_si128((__m128i*)(out + i + 4), _mm256_cvtpd_epi32(idx1));
+    }
+    assign_scalar(xs + i, ys + i, n - i, cx, cy, k, out + i);
+}
+#endif
+
+// Nearest of the k centres (cx, cy) for n points, with the given SoA kernel.
+void assign_columns(AssignKernel kernel, const double* xs, const double* ys, size_t n,
+                    const double* cx, const double* cy, size_t k, int* out) {
+    switch (kernel) {
+#if defined(__x86_64__) || defined(__i386__)
+        case AssignKernel::SSE2:
+            assign_sse2(xs, ys, n, cx, cy, k, out);
+            return;
+        case AssignKernel::AVX2:
+            assign_avx2(xs, ys, n, cx, cy, k, out);
+            return;
+#endif
+        default:
+            assign_scalar(xs, ys, n, cx, cy, k, out);
+            return;
+    }
+}
+
+// Nearest centroid for points [begin, end) written into out[begin, end).
+void assign_range(AssignKernel kernel, size_t begin, size_t end, int* out) {
+    const double* xs = column_x + begin;
+    const double* ys = column_y + begin;
+    const double* cx = centroid_xs.data();
+    const double* cy = centroid_ys.data();
+    const size_t n = end - begin;
+    const size_t k = centroids.size();
+
+    switch (kernel) {
+        case AssignKernel::Reference:
+            for (size_t i = begin; i < end; ++i) {
+                int closest_cluster = -1;
+                double min_distance = std::numeric_limits<double>::max();
+                for (size_t c = 0; c < k; ++c) {
+                    double distance = calculate_distance(points[i], centroids[c]);
+                    if (distance < min_distance) {
+                        min_distance = distance;
+                        closest_cluster = c;
+                    }
+                }
+                out[i] = closest_cluster;
+            }
+            return;
+        default:
+            assign_columns(kernel, xs, ys, n, cx, cy, k, out + begin);
+            return;
+    }
+}
+
+// ---- Reduced precision ----
+// --precision=mixed runs the linear scan on float32 copies of the coordinates,
+// which halves the bytes read per point, and still returns exactly what the
+// double kernel would. Coordinates are stored relative to the middle of the
+// bounding box, so every float error is bounded by a multiple of M, the
+// largest centred coordinate of any point or centroid. Rounding the
+// coordinates, the subtraction, the squares and the sum together move a
+// float distance by less than 9 * 2^-24 * M. The kernels also track the
+// runner-up. If the float distance of the runner-up exceeds the winner's by
+// more than twice the bound (REDUCED_MARGIN_SCALE * M), the float winner is
+// the double winner. Any other point, ties included, is rescanned in double
+// with the active kernel. Hamerly pruning and the centroid tree keep the
+// double path.
+
+enum class AssignPrecision { Double, Mixed };
+
+AssignPrecision assign_precision = AssignPrecision::Double;
+std::atomic<uint64_t> exact_fallbacks(0);   // points the mixed path rescanned in double
+
+const double REDUCED_MARGIN_SCALE = 0x1p-19;   // 32 * 2^-24, twice the float error bound
+
+const char* assign_precision_name(AssignPrecision precision) {
+    switch (precision) {
+        case AssignPrecision::Double: return "double";
+        case AssignPrecision::Mixed: return "mixed";
+    }
+    return "unknown";
+}
+
+struct ReducedColumns {
+    double origin_x = 0.0, origin_y = 0.0;
+    double point_extent = 0.0;      // largest centred point coordinate
+    std::vector<float> cx, cy;      // centred centroids
+    double margin = 0.0;            // certification gap in distance units
+    bool usable = false;
+};
+
+ReducedColumns reduced;
+
+// Float point copies are rebuilt after use_point_columns marks them stale;
+// centroid copies and the margin are refreshed every call. Must run before
+// the assignment is split across threads.
+void prepare_reduced_precision() {
+    reduced.usable = false;
+    if (assign_precision != AssignPrecision::Mixed || assign_kernel == AssignKernel::Reference) return;
+
+    const size_t n = column_size;
+    if (reduced_xs.size() != n) {
+        double min_x = std::numeric_limits<double>::max(), max_x = -min_x;
+        double min_y = min_x, max_y = -min_x;
+        for (size_t i = 0; i < n; ++i) {
+            min_x = std::min(min_x, column_x[i]);
+            max_x = std::max(max_x, column_x[i]);
+            min_y = std::min(min_y, column_y[i]);
+            max_y = std::max(max_y, column_y[i]);
+        }
+        reduced.origin_x = n ? 0.5 * (min_x + max_x) : 0.0;
+        reduced.origin_y = n ? 0.5 * (min_y + max_y) : 0.0;
+        reduced.point_extent = 0.0;
+        reduced_xs.resize(n);
+        reduced_ys.resize(n);
+        for (size_t i = 0; i < n; ++i) {
+            const double x = column_x[i] - reduced.origin_x;
+            const double y = column_y[i] - reduced.origin_y;
+            reduced.point_extent = std::max(reduced.point_extent, std::max(std::fabs(x), std::fabs(y)));
+            reduced_xs[i] = (float)x;
+            reduced_ys[i] = (float)y;
+        }
+    }
+
+    const size_t k = centroid_xs.size();
+    double extent = reduced.point_extent;
+    reduced.cx.resize(k);
+    reduced.cy.resize(k);
+    for (size_t c = 0; c < k; ++c) {
+        const double x = centroid_xs[c] - reduced.origin_x;
+        const double y = centroid_ys[c] - reduced.origin_y;
+        extent = std::max(extent, std::max(std::fabs(x), std::fabs(y)));
+        reduced.cx[c] = (float)x;
+        reduced.cy[c] = (float)y;
+    }
+    reduced.margin = REDUCED_MARGIN_SCALE * extent;
+    // Far from float range the error bound no longer holds; stay on doubles.
+    reduced.usable = k > 0 && extent < 1e18;
+}
+
+// Float nearest and runner-up squared distances for n points. A distance
+// equal to the best goes to second, so ties always fail certification.
+// second = min(second, max(best, d)) keeps the runner-up without branches.
+static void reduced_scan_scalar(const float* xs, const float* ys, size_t n, const float* cx, const float* cy,
+                                size_t k, int* index, float* best, float* second) {
+    for (size_t i = 0; i < n; ++i) {
+        float b = std::numeric_limits<float>::infinity(), s = b;
+        int closest = -1;
+        for (size_t c = 0; c < k; ++c) {
+            float dx = xs[i] - cx[c];
+            float dy = ys[i] - cy[c];
+            float d = dx * dx + dy * dy;
+            s = std::min(s, std::max(b, d));
+            if (d < b) {
+                b = d;
+                closest = c;
+            }
+        }
+        index[i] = closest;
+        best[i] = b;
+        second[i] = s;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static void reduced_scan_sse2(const float* xs, const float* ys, size_t n, const float* cx, const float* cy,
+                              size_t k, int* index, float* best, float* second) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 px = _mm_loadu_ps(xs + i), py = _mm_loadu_ps(ys + i);
+        __m128 b = _mm_set1_ps(std::numeric_limits<float>::infinity()), s = b;
+        __m128i idx = _mm_set1_epi32(-1);
+
+        for (size_t c = 0; c < k; ++c) {
+            __m128 dx = _mm_sub_ps(px, _mm_set1_ps(cx[c]));
+            __m128 dy = _mm_sub_ps(py, _mm_set1_ps(cy[c]));
+            __m128 d = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+            __m128i lt = _mm_castps_si128(_mm_cmplt_ps(d, b));
+            s = _mm_min_ps(s, _mm_max_ps(b, d));
+            b = _mm_min_ps(b, d);
+            idx = _mm_or_si128(_mm_and_si128(lt, _mm_set1_epi32((int)c)), _mm_andnot_si128(lt, idx));
+        }
+        _mm_storeu_si128((__m128i*)(index + i), idx);
+        _mm_storeu_ps(best + i, b);
+        _mm_storeu_ps(second + i, s);
+    }
+    reduced_scan_scalar(xs + i, ys + i, n - i, cx, cy, k, index + i, best + i, second + i);
+}
+
+__attribute__((target("avx2")))
+static void reduced_scan_avx2(const float* xs, const float* ys, size_t n, const float* cx, const float* cy,
+                              size_t k, int* index, float* best, float* second) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256 px0 = _mm256_loadu_ps(xs + i), px1 = _mm256_loadu_ps(xs + i + 8);
+        __m256 py0 = _mm256_loadu_ps(ys + i), py1 = _mm256_loadu_ps(ys + i + 8);
+        __m256 b0 = _mm256_set1_ps(std::numeric_limits<float>::infinity()), b1 = b0, s0 = b0, s1 = b0;
+        __m256 idx0 = _mm256_set1_ps(-1.0f), idx1 = idx0;
+
+        for (size_t c = 0; c < k; ++c) {
+            __m256 ccx = _mm256_set1_ps(cx[c]);
+            __m256 ccy = _mm256_set1_ps(cy[c]);
+            __m256 cidx = _mm256_set1_ps((float)c);
+
+            __m256 dx0 = _mm256_sub_ps(px0, ccx), dy0 = _mm256_sub_ps(py0, ccy);
+            __m256 dx1 = _mm256_sub_ps(px1, ccx), dy1 = _mm256_sub_ps(py1, ccy);
+            __m256 d0 = _mm256_add_ps(_mm256_mul_ps(dx0, dx0), _mm256_mul_ps(dy0, dy0));
+            __m256 d1 = _mm256_add_ps(_mm256_mul_ps(dx1, dx1), _mm256_mul_ps(dy1, dy1));
+
+            __m256 lt0 = _mm256_cmp_ps(d0, b0, _CMP_LT_OQ);
+            __m256 lt1 = _mm256_cmp_ps(d1, b1, _CMP_LT_OQ);
+            s0 = _mm256_min_ps(s0, _mm256_max_ps(b0, d0));
+            s1 = _mm256_min_ps(s1, _mm256_max_ps(b1, d1));
+            b0 = _mm256_min_ps(b0, d0);
+            b1 = _mm256_min_ps(b1, d1);
+            idx0 = _mm256_blendv_ps(idx0, cidx, lt0);
+            idx1 = _mm256_blendv_ps(idx1, cidx, lt1);
+        }
+
+        _mm256_storeu_si256((__m256i*)(index + i), _mm256_cvtps_epi32(idx0));
+        _mm256_storeu_si256((__m256i*)(index + i + 8), _mm256_cvtps_epi32(idx1));
+        _mm256_storeu_ps(best + i, b0);
+        _mm256_storeu_ps(best + i + 8, b1);
+        _mm256_storeu_ps(second + i, s0);
+        _mm256_storeu_ps(second + i + 8, s1);
+    }
+    reduced_scan_scalar(xs + i, ys + i, n - i, cx, cy, k, index + i, best + i, second + i);
+}
+#endif
+
+// Nearest centroid for points [begin, end) through the float scan, with
+// uncertain points rescanned in double. Same result as assign_range.
+void reduced_assign_range(size_t begin, size_t end, int* out) {
+    constexpr size_t BLOCK = 256;
+    float best[BLOCK], second[BLOCK];
+    const size_t k = reduced.cx.size();
+    const double margin = reduced.margin;
+    uint64_t fallbacks = 0;
+
+    for (size_t start = begin; start < end; start += BLOCK) {
+        const size_t m = std::min(BLOCK, end - start);
+        const float* xs = reduced_xs.data() + start;
+        const float* ys = reduced_ys.data() + start;
+        int* index = out + start;
+        switch (assign_kernel) {
+#if defined(__x86_64__) || defined(__i386__)
+            case AssignKernel::SSE2:
+                reduced_scan_sse2(xs, ys, m, reduced.cx.data(), reduced.cy.data(), k, index, best, second);
+                break;
+            case AssignKernel::AVX2:
+                reduced_scan_avx2(xs, ys, m, reduced.cx.data(), reduced.cy.data(), k, index, best, second);
+                break;
+#endif
+            default:
+                reduced_scan_scalar(xs, ys, m, reduced.cx.data(), reduced.cy.data(), k, index, best, second);
+                break;
+        }
+
+        for (size_t j = 0; j < m; ++j) {
+            const double reach = std::sqrt((double)best[j]) + margin;
+            if ((double)second[j] > reach * reach) continue;
+            const size_t i = start + j;
+            assign_columns(assign_kernel, column_x + i, column_y + i, 1,
+                           centroid_xs.data(), centroid_ys.data(), centroid_xs.size(), out + i);
+            fallbacks++;
+        }
+    }
+    exact_fallbacks += fallbacks;
+}
+
+// ---- Triangle-inequality pruning (Hamerly) ----
+// Each point keeps an upper bound on the distance to its own centroid and a
+// lower bound on the distance to every other centroid. Bounds are loosened by
+// how far the centroids moved; a point whose upper bound stays below both its
+// lower bound and half the gap to the nearest other centroid cannot change
+// cluster, so its centroid loop is skipped. Bounds are compared with a small
+// tolerance so rounding never prunes a point the full scan would move.
+
+enum class PruneMode { None, Hamerly };
+
+PruneMode prune_mode = PruneMode::None;
+std::atomic<uint64_t> distances_computed(0);
+std::atomic<uint64_t> distances_skipped(0);
+
+struct HamerlyState {
+    std::vector<double> upper, lower;
+    std::vector<int> assigned;                 // -1 forces a full scan
+    std::vector<Centroid> bound_centroids;     // centroid positions the bounds refer to
+    std::vector<double> drift, half_separation;
+    double max_drift = 0.0, second_drift = 0.0;
+    int max_drift_cluster = -1;
+    double tolerance = 0.0;
+};
+
+HamerlyState hamerly;
+
+// Drops all bounds; called whenever the point set is replaced.
+void hamerly_reset() {
+    hamerly.upper.clear();
+    hamerly.lower.clear();
+    hamerly.assigned.clear();
+    hamerly.bound_centroids.clear();
+}
+
+static double centroid_distance(const Centroid& a, const Centroid& b) {
+    double dx = a.x - b.x;
+    double dy = a.y - b.y;
+    return std::sqrt(dx * dx + dy * dy);
+}
+
+void hamerly_prepare() {
+    const size_t n = points.size();
+    const size_t k = centroids.size();
+
+    if (hamerly.assigned.size() != n || hamerly.bound_centroids.size() != k) {
+        hamerly.upper.assign(n, 0.0);
+        hamerly.lower.assign(n, 0.0);
+        hamerly.assigned.assign(n, -1);
+        hamerly.bound_centroids = centroids;
+
+        double scale = 1.0;
+        for (size_t i = 0; i < n; ++i) {
+            scale = std::max(scale, std::max(std::fabs(column_x[i]), std::fabs(column_y[i])));
+        }
+        hamerly.tolerance = 1e-9 * scale;
+    }
+
+    hamerly.drift.assign(k, 0.0);
+    hamerly.max_drift = hamerly.second_drift = 0.0;
+    hamerly.max_drift_cluster = -1;
+    for (size_t c = 0; c < k; ++c) {
+        double d = centroid_distance(hamerly.bound_centroids[c], centroids[c]);
+        hamerly.drift[c] = d;
+        if (d > hamerly.max_drift) {
+            hamerly.second_drift = hamerly.max_drift;
+            hamerly.max_drift = d;
+            hamerly.max_drift_cluster = c;
+        } else if (d > hamerly.second_drift) {
+            hamerly.second_drift = d;
+        }
+    }
+    hamerly.bound_centroids = centroids;
+
+    hamerly.half_separation.assign(k, std::numeric_limits<double>::infinity());
+    for (size_t a = 0; a < k; ++a) {
+        for (size_t b = a + 1; b < k; ++b) {
+            double half = 0.5 * centroid_distance(centroids[a], centroids[b]);
+            hamerly.half_separation[a] = std::min(hamerly.half_separation[a], half);
+            hamerly.half_separation[b] = std::min(hamerly.half_separation[b], half);
+        }
+    }
+}
+
+void hamerly_assign_range(size_t begin, size_t end) {
+    const double* cx = centroid_xs.data();
+    const double* cy = centroid_ys.data();
+    const size_t k = centroids.size();
+    const double tol = hamerly.tolerance;
+    uint64_t computed = 0;
+
+    for (size_t i = begin; i < end; ++i) {
+        const double x = column_x[i];
+        const double y = column_y[i];
+        int a = hamerly.assigned[i];
+
+        if (a >= 0) {
+            hamerly.upper[i] += hamerly.drift[a];
+            hamerly.lower[i] -= a == hamerly.max_drift_cluster ? hamerly.second_drift : hamerly.max_drift;
+
+            double z = std::max(hamerly.lower[i], hamerly.half_separation[a]);
+            if (hamerly.upper[i] + tol < z) {
+                nearest_cluster[i] = a;
+                continue;
+            }
+
+            double dx = x - cx[a];
+            double dy = y - cy[a];
+            hamerly.upper[i] = std::sqrt(dx * dx + dy * dy);
+            computed++;
+            if (hamerly.upper[i] + tol < z) {
+                nearest_cluster[i] = a;
+                continue;
+            }
+        }
+
+        // Full scan comparing roots like assign_scalar, also tracking the
+        // runner-up for the lower bound.
+        int closest_cluster = -1;
+        double min_distance = std::numeric_limits<double>::max();
+        double second_distance = std::numeric_limits<double>::infinity();
+        for (size_t c = 0; c < k; ++c) {
+            double dx = x - cx[c];
+            double dy = y - cy[c];
+            double distance = std::sqrt(dx * dx + dy * dy);
+            if (distance < min_distance) {
+                second_distance = std::min(second_distance, min_distance);
+                min_distance = distance;
+                closest_cluster = c;
+            } else if (distance < second_distance) {
+                second_distance = distance;
+            }
+        }
+        computed += k;
+
+        hamerly.assigned[i] = closest_cluster;
+        hamerly.upper[i] = min_distance;
+        hamerly.lower[i] = second_distance;
+        nearest_cluster[i] = closest_cluster;
+    }
+
+    const uint64_t total = (uint64_t)(end - begin) * k;
+    distances_computed += computed;
+    distances_skipped += total > computed ? total - computed : 0;
+}
+
+// ---- Centroid index ----
+// For large K the linear scan is replaced by a 2-D k-d tree over the centroids,
+// rebuilt once per iteration. Each inner node splits its centroids at the
+// median of the wider axis; leaves hold up to LEAF_SIZE centroids that are
+// scanned linearly. A query starts from a hint (the point's previous cluster) so the first
+// bound is usually already tight. Distances are compared as roots like the
+// linear scan. Subtrees are skipped only when the distance to the split line
+// is strictly greater than the best distance, and equal distances resolve to
+// the lowest index, so the result is exactly the one the linear scan gives.
+
+enum class CentroidIndex { None, Auto, KdTree };
+
+const size_t CENTROID_INDEX_THRESHOLD = 512; // Auto uses the tree from this K up
+
+CentroidIndex centroid_index = CentroidIndex::Auto;
+
+const char* centroid_index_name(CentroidIndex index) {
+    switch (index) {
+        case CentroidIndex::None: return "none";
+        case CentroidIndex::Auto: return "auto";
+        case CentroidIndex::KdTree: return "kdtree";
+    }
+    return "unknown";
+}
+
+class CentroidTree {
+public:
+    void build(const std::vector<Centroid>& cents) {
+        const size_t k = cents.size();
+        std::vector<int> order(k);
+        hint_x.resize(k);
+        hint_y.resize(k);
+        for (size_t c = 0; c < k; ++c) {
+            order[c] = c;
+            hint_x[c] = cents[c].x;
+            hint_y[c] = cents[c].y;
+        }
+        nodes.clear();
+        build_node(cents, order, 0, k);
+
+        leaf_x.resize(k);
+        leaf_y.resize(k);
+        leaf_index.resize(k);
+        for (size_t i = 0; i < k; ++i) {
+            leaf_x[i] = cents[order[i]].x;
+            leaf_y[i] = cents[order[i]].y;
+            leaf_index[i] = order[i];
+        }
+    }
+
+    // Nearest centroid to (x, y); hint is a centroid index to seed the search
+    // with, or -1. computed is incremented once per distance evaluated.
+    int nearest(double x, double y, int hint, uint64_t& computed) const {
+        double best = std::numeric_limits<double>::max();
+        int best_index = -1;
+        if (hint >= 0 && (size_t)hint < hint_x.size()) {
+            double dx = x - hint_x[hint];
+            double dy = y - hint_y[hint];
+            best = std::sqrt(dx * dx + dy * dy);
+            best_index = hint;
+            computed++;
+        }
+        if (nodes.empty()) return best_index;
+
+        // Pending subtrees with a lower bound on their distance.
+        struct Pending { int node; double bound; };
+        Pending stack[64];
+        int top = 0;
+        stack[top++] = { 0, 0.0 };
+
+        while (top > 0) {
+            const Pending pending = stack[--top];
+            if (pending.bound > best) continue;
+            const Node& node = nodes[pending.node];
+
+            if (node.left < 0) {
+                for (uint32_t i = node.lo; i < node.hi; ++i) {
+                    double dx = x - leaf_x[i];
+                    double dy = y - leaf_y[i];
+                    double distance = std::sqrt(dx * dx + dy * dy);
+                    if (distance < best || (distance == best && leaf_index[i] < best_index)) {
+                        best = distance;
+                        best_index = leaf_index[i];
+                    }
+                }
+                computed += node.hi - node.lo;
+                continue;
+            }
+
+            const double diff = (node.axis ? y : x) - node.split;
+            const int near_child = diff < 0 ? node.left : node.right;
+            const int far_child = diff < 0 ? node.right : node.left;
+            // sqrt(diff * diff) rather than |diff| so the bound rounds the same
+            // way as a leaf distance and never exceeds one
+            stack[top++] = { far_child, std::max(pending.bound, std::sqrt(diff * diff)) };
+            stack[top++] = { near_child, pending.bound };
+        }
+        return best_index;
+    }
+
+private:
+    static const size_t LEAF_SIZE = 16;
+
+    // Leaves own leaf_*[lo, hi). Inner nodes split on axis at split: the left
+    // child holds coordinates <= split and the right child coordinates >= split.
+    struct Node {
+        double split;
+        uint32_t lo, hi;
+        int left, right;
+        uint8_t axis;
+    };
+
+    int build_node(const std::vector<Centroid>& cents, std::vector<int>& order, size_t lo, size_t hi) {
+        const int id = nodes.size();
+        nodes.push_back(Node{ 0.0, (uint32_t)lo, (uint32_t)hi, -1, -1, 0 });
+        if (hi - lo <= LEAF_SIZE) return id;
+
+        double min_x = std::numeric_limits<double>::max(), max_x = -min_x;
+        double min_y = min_x, max_y = -min_x;
+        for (size_t i = lo; i < hi; ++i) {
+            const Centroid& c = cents[order[i]];
+            min_x = std::min(min_x, c.x);
+            max_x = std::max(max_x, c.x);
+            min_y = std::min(min_y, c.y);
+            max_y = std::max(max_y, c.y);
+        }
+        const int axis = max_y - min_y > max_x - min_x ? 1 : 0;
+        const size_t mid = lo + (hi - lo) / 2;
+        std::nth_element(order.begin() + lo, order.begin() + mid, order.begin() + hi, [&](int a, int b) {
+            return cents[a][axis] < cents[b][axis];
+        });
+
+        const double split = cents[order[mid]][axis];
+        const int left = build_node(cents, order, lo, mid);
+        const int right = build_node(cents, order, mid, hi);
+        Node& node = nodes[id];
+        node.split = split;
+        node.axis = axis;
+        node.left = left;
+        node.right = right;
+        return id;
+    }
+
+    std::vector<Node> nodes;
+    std::vector<double> leaf_x, leaf_y;  // centroids in leaf order
+    std::vector<int> leaf_index;
+    std::vector<double> hint_x, hint_y;  // centroids by index
+};
+
+CentroidTree centroid_tree;
+
+bool centroid_index_active() {
+    switch (centroid_index) {
+        case CentroidIndex::KdTree: return true;
+        case CentroidIndex::Auto: return centroids.size() >= CENTROID_INDEX_THRESHOLD;
+        default: return false;
+    }
+}
+
+// Rebuilds the tree from the current centroids if the index is in use.
+void prepare_centroid_index() {
+    if (centroid_index_active()) {
+        centroid_tree.build(centroids);
+    }
+}
+
+// Points whose cluster is a valid centroid index use it as the search hint.
+void tree_assign_range(size_t begin, size_t end, int* out) {
+    const size_t k = centroids.size();
+    const bool hinted = points.size() == column_size;
+    uint64_t computed = 0;
+    for (size_t i = begin; i < end; ++i) {
+        int hint = hinted ? points[i].cluster : -1;
+        out[i] = centroid_tree.nearest(column_x[i], column_y[i], hint, computed);
+    }
+    const uint64_t total = (uint64_t)(end - begin) * k;
+    distances_computed += computed;
+    distances_skipped += total > computed ? total - computed : 0;
+}
+
+// Nearest centroid of points [begin, end) into out without pruning bounds:
+// through the centroid tree when it is active, otherwise the linear kernel.
+void nearest_range(size_t begin, size_t end, int* out) {
+    if (centroid_index_active()) {
+        tree_assign_range(begin, end, out);
+        return;
+    }
+    if (reduced.usable) {
+        reduced_assign_range(begin, end, out);
+    } else {
+        assign_range(assign_kernel, begin, end, out);
+    }
+    distances_computed += (uint64_t)(end - begin) * centroids.size();
+}
+
+// Writes the nearest centroid of points [begin, end) into nearest_cluster
+// using whichever assignment strategy is active.
+void assign_points(size_t begin, size_t end) {
+    if (prune_mode == PruneMode::Hamerly) {
+        hamerly_assign_range(begin, end);
+        return;
+    }
+    nearest_range(begin, end, nearest_cluster.data());
+}
+
+// ---- Worker pool ----
+// Persistent threads that pick up task indices from a shared counter. The
+// calling thread takes part too, so a pool of N threads keeps N-1 workers.
+
+class WorkerPool {
+public:
+    explicit WorkerPool(unsigned num_threads) {
+        for (unsigned i = 1; i < num_threads; ++i) {
+            workers.emplace_back(&WorkerPool::worker_loop, this);
+        }
+    }
+
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    unsigned size() const { return workers.size() + 1; }
+
+    // Runs task(i) for every i in [0, count) and returns once all have finished.
+    void parallel_for(size_t count, const std::function<void(size_t)>& task) {
+        if (count == 0) return;
+        if (workers.empty() || count == 1) {
+            for (size_t i = 0; i < count; ++i) task(i);
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = &task;
+            job_count = count;
+            next_task = 0;
+            busy_workers = workers.size();
+            generation++;
+        }
+        wake.notify_all();
+
+        run_tasks(task, count);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return busy_workers == 0; });
+        job = nullptr;
+    }
+
+private:
+    void run_tasks(const std::function<void(size_t)>& task, size_t count) {
+        for (size_t i = next_task++; i < count; i = next_task++) {
+            task(i);
+        }
+    }
+
+    void worker_loop() {
+        uint64_t seen_generation = 0;
+        while (true) {
+            const std::function<void(size_t)>* task;
+            size_t count;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping || generation != seen_generation; });
+                if (stopping) return;
+                seen_generation = generation;
+                task = job;
+                count = job_count;
+            }
+
+            run_tasks(*task, count);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--busy_workers == 0) {
+                done.notify_one();
+            }
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    const std::function<void(size_t)>* job = nullptr;
+    size_t job_count = 0;
+    std::atomic<size_t> next_task{0};
+    size_t busy_workers = 0;
+    uint64_t generation = 0;
+    bool stopping = false;
+};
+
+// ---- Parallel iteration ----
+// Points are cut into fixed-size chunks regardless of the thread count. Each
+// chunk assigns its points and accumulates its own partial sums; the partials
+// are then merged pairwise in a fixed tree, so centroids come out bit-for-bit
+// the same whether one thread or thirty-two did the work.
+
+const size_t PARALLEL_CHUNK_SIZE = 65536;
+
+std::unique_ptr<WorkerPool> worker_pool; // null means the serial path is used
+std::vector<double> chunk_sum_x, chunk_sum_y;
+std::vector<int> chunk_count;
+std::vector<size_t> chunk_reassigned;
+
+// Returns the number of points whose cluster changed. With deltas_only the
+// chunks only look at reassigned points and the reduced changes are added to
+// sum_x/sum_y/count instead of replacing them.
+size_t parallel_assign_and_sum(std::vector<double>& sum_x, std::vector<double>& sum_y, std::vector<int>& count,
+                               bool deltas_only) {
+    const size_t n = points.size();
+    const size_t k = centroids.size();
+    const size_t num_chunks = std::max<size_t>(1, (n + PARALLEL_CHUNK_SIZE - 1) / PARALLEL_CHUNK_SIZE);
+
+    chunk_sum_x.assign(num_chunks * k, 0.0);
+    chunk_sum_y.assign(num_chunks * k, 0.0);
+    chunk_count.assign(num_chunks * k, 0);
+    chunk_reassigned.assign(num_chunks, 0);
+    nearest_cluster.resize(n);
+
+    worker_pool->parallel_for(num_chunks, [&](size_t chunk) {
+        const size_t begin = chunk * PARALLEL_CHUNK_SIZE;
+        const size_t end = std::min(n, begin + PARALLEL_CHUNK_SIZE);
+        if (begin >= end) return;
+
+        assign_points(begin, end);
+
+        double* part_x = chunk_sum_x.data() + chunk * k;
+        double* part_y = chunk_sum_y.data() + chunk * k;
+        int* part_count = chunk_count.data() + chunk * k;
+        size_t reassigned = 0;
+        for (size_t i = begin; i < end; ++i) {
+            int cluster = nearest_cluster[i];
+            int previous = points[i].cluster;
+            if (previous != cluster) {
+                points[i].cluster = cluster;
+                reassigned++;
+                if (deltas_only && previous >= 0) {
+                    part_x[previous] -= column_x[i];
+                    part_y[previous] -= column_y[i];
+                    part_count[previous]--;
+                }
+            } else if (deltas_only) {
+                continue;
+            }
+            if (cluster >= 0) {
+                part_x[cluster] += column_x[i];
+                part_y[cluster] += column_y[i];
+                part_count[cluster]++;
+            }
+        }
+        chunk_reassigned[chunk] = reassigned;
+    });
+
+    // Pairwise tree reduction into chunk 0.
+    for (size_t stride = 1; stride < num_chunks; stride *= 2) {
+        const size_t pairs = (num_chunks + 2 * stride - 1) / (2 * stride);
+        worker_pool->parallel_for(pairs, [&](size_t pair) {
+            const size_t dst = pair * 2 * stride;
+            const size_t src = dst + stride;
+            if (src >= num_chunks) return;
+            for (size_t c = 0; c < k; ++c) {
+                chunk_sum_x[dst * k + c] += chunk_sum_x[src * k + c];
+                chunk_sum_y[dst * k + c] += chunk_sum_y[src * k + c];
+                chunk_count[dst * k + c] += chunk_count[src * k + c];
+            }
+        });
+    }
+
+    if (deltas_only) {
+        for (size_t c = 0; c < k; ++c) {
+            sum_x[c] += chunk_sum_x[c];
+            sum_y[c] += chunk_sum_y[c];
+            count[c] += chunk_count[c];
+        }
+    } else {
+        std::copy(chunk_sum_x.begin(), chunk_sum_x.begin() + k, sum_x.begin());
+        std::copy(chunk_sum_y.begin(), chunk_sum_y.begin() + k, sum_y.begin());
+        std::copy(chunk_count.begin(), chunk_count.begin() + k, count.begin());
+    }
+
+    size_t reassigned = 0;
+    for (size_t r : chunk_reassigned) {
+        reassigned += r;
+    }
+    return reassigned;
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// ---- Seeding ----
+// k-means++ (Arthur & Vassilvitskii) picks each new centroid with probability
+// proportional to its squared distance from the centroids chosen so far.
+// k-means|| (Bahmani et al.) oversamples about 2K candidates per round with
+// independent per-point coin flips, which parallelise, then reduces the
+// weighted candidates to K with k-means++. Per-point costs are summed in the
+// fixed PARALLEL_CHUNK_SIZE chunks and every random draw comes from --seed,
+// so the chosen centroids do not depend on the thread count.
+
+enum class InitMode { File, KMeansPlusPlus, KMeansParallel };
+enum class EmptyPolicy { Keep, Farthest, Random };
+
+InitMode init_mode = InitMode::File;
+EmptyPolicy empty_policy = EmptyPolicy::Keep;
+std::mt19937_64 reseed_rng(1);
+std::atomic<uint64_t> empty_reseeds(0);
+double init_seconds = 0.0;
+
+const char* init_mode_name(InitMode mode) {
+    switch (mode) {
+        case InitMode::File: return "file";
+        case InitMode::KMeansPlusPlus: return "kmeans++";
+        case InitMode::KMeansParallel: return "kmeans||";
+    }
+    return "unknown";
+}
+
+// Seeding scratch: each point's squared distance to the nearest chosen centre
+// and the per-chunk sums of those. The main seeding spreads the chunks over
+// the worker pool; a sweep job already runs on a pool thread and seeds with
+// its own serial state.
+struct SeedState {
+    std::vector<double> min_d2;
+    std::vector<double> chunk_cost;
+    bool parallel = true;
+};
+
+SeedState seed_state;
+
+// Runs task(begin, end) for every chunk, on the pool when there is one and
+// parallel is set.
+static void for_each_chunk(size_t n, const std::function<void(size_t, size_t, size_t)>& task,
+                           bool parallel = true) {
+    const size_t num_chunks = (n + PARALLEL_CHUNK_SIZE - 1) / PARALLEL_CHUNK_SIZE;
+    auto run = [&](size_t chunk) {
+        const size_t begin = chunk * PARALLEL_CHUNK_SIZE;
+        task(chunk, begin, std::min(n, begin + PARALLEL_CHUNK_SIZE));
+    };
+    if (parallel && worker_pool) {
+        worker_pool->parallel_for(num_chunks, run);
+    } else {
+        for (size_t chunk = 0; chunk < num_chunks; ++chunk) run(chunk);
+    }
+}
+
+// Lowers min_d2 to account for new centres and refreshes the chunk costs.
+static double update_min_distances(SeedState& state, const std::vector<Centroid>& fresh) {
+    const size_t n = column_size;
+    state.chunk_cost.resize((n + PARALLEL_CHUNK_SIZE - 1) / PARALLEL_CHUNK_SIZE);
+    for_each_chunk(n, [&](size_t chunk, size_t begin, size_t end) {
+        double cost = 0.0;
+        for (size_t i = begin; i < end; ++i) {
+            double best = state.min_d2[i];
+            for (const auto& c : fresh) {
+                double dx = column_x[i] - c.x;
+                double dy = column_y[i] - c.y;
+                best = std::min(best, dx * dx + dy * dy);
+            }
+            state.min_d2[i] = best;
+            cost += best;
+        }
+        state.chunk_cost[chunk] = cost;
+    }, state.parallel);
+    distances_computed += (uint64_t)n * fresh.size();
+
+    double total = 0.0;
+    for (double cost : state.chunk_cost) total += cost;
+    return total;
+}
+
+// Index whose cumulative cost first exceeds target, walking chunks in order.
+static size_t sample_by_cost(const SeedState& state, double target) {
+    const size_t n = column_size;
+    size_t chunk = 0;
+    while (chunk + 1 < state.chunk_cost.size() && target >= state.chunk_cost[chunk]) {
+        target -= state.chunk_cost[chunk++];
+    }
+    const size_t begin = chunk * PARALLEL_CHUNK_SIZE;
+    const size_t end = std::min(n, begin + PARALLEL_CHUNK_SIZE);
+    size_t last_positive = begin;
+    for (size_t i = begin; i < end; ++i) {
+        if (state.min_d2[i] <= 0.0) continue;
+        last_positive = i;
+        if (target < state.min_d2[i]) return i;
+        target -= state.min_d2[i];
+    }
+    return last_positive;
+}
+
+static Centroid centroid_at(size_t i) {
+    return Centroid{ column_x[i], column_y[i] };
+}
+
+// Adds k-means++ picks until chosen holds k centres. state.min_d2 must hold
+// each point's squared distance to chosen and total their sum. Points at
+// distance zero coincide with a chosen centre and are never sampled while any
+// other point is left.
+static void extend_kmeans_plus_plus(SeedState& state, std::vector<Centroid>& chosen, size_t k,
+                                    double total, std::mt19937_64& rng) {
+    std::uniform_int_distribution<size_t> pick(0, column_size - 1);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    while (chosen.size() < k) {
+        // Every point coincides with a chosen centroid: fall back to uniform picks.
+        size_t next = total > 0.0 ? sample_by_cost(state, unit(rng) * total) : pick(rng);
+        chosen.push_back(centroid_at(next));
+        total = update_min_distances(state, { chosen.back() });
+    }
+}
+
+std::vector<Centroid> seed_kmeans_plus_plus(size_t k, std::mt19937_64& rng, SeedState& state) {
+    const size_t n = column_size;
+    std::vector<Centroid> chosen;
+    std::uniform_int_distribution<size_t> pick(0, n - 1);
+
+    chosen.push_back(centroid_at(pick(rng)));
+    state.min_d2.assign(n, std::numeric_limits<double>::infinity());
+    extend_kmeans_plus_plus(state, chosen, k, update_min_distances(state, chosen), rng);
+    return chosen;
+}
+
+// Uniform double in [0, 1) from (seed, round, index) so each point can flip
+// its own coin on any thread.
+static double hashed_unit(uint64_t seed, uint64_t round, uint64_t index) {
+    uint64_t z = seed ^ (round * 0x9e3779b97f4a7c15ull) ^ (index * 0xbf58476d1ce4e5b9ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    z ^= z >> 31;
+    return (z >> 11) * (1.0 / 9007199254740992.0);
+}
+
+std::vector<Centroid> seed_kmeans_parallel(size_t k, std::mt19937_64& rng, uint64_t seed) {
+    const size_t n = column_size;
+    const int rounds = 5;
+    const double oversampling = 2.0 * k;
+    std::uniform_int_distribution<size_t> pick(0, n - 1);
+
+    std::vector<Centroid> candidates{ centroid_at(pick(rng)) };
+    seed_state.min_d2.assign(n, std::numeric_limits<double>::infinity());
+    double cost = update_min_distances(seed_state, candidates);
+
+    const size_t num_chunks = (n + PARALLEL_CHUNK_SIZE - 1) / PARALLEL_CHUNK_SIZE;
+    std::vector<std::vector<size_t>> sampled(num_chunks);
+    for (int round = 0; round < rounds && cost > 0.0; ++round) {
+        for_each_chunk(n, [&](size_t chunk, size_t begin, size_t end) {
+            sampled[chunk].clear();
+            for (size_t i = begin; i < end; ++i) {
+                double p = oversampling * seed_state.min_d2[i] / cost;
+                if (hashed_unit(seed, round, i) < p) sampled[chunk].push_back(i);
+            }
+        });
+
+        std::vector<Centroid> fresh;
+        for (const auto& chunk : sampled) {
+            for (size_t i : chunk) fresh.push_back(centroid_at(i));
+        }
+        if (fresh.empty()) continue;
+        candidates.insert(candidates.end(), fresh.begin(), fresh.end());
+        cost = update_min_distances(seed_state, fresh);
+    }
+
+    if (candidates.size() <= k) {
+        // Too few candidates (tiny or heavily duplicated data): drop repeated
+        // coordinates and top up with k-means++, which only draws points away
+        // from every candidate. seed_state already covers all candidates.
+        std::vector<Centroid> chosen;
+        std::set<std::pair<double, double>> seen;
+        for (const auto& c : candidates) {
+            if (seen.insert({ c.x, c.y }).second) chosen.push_back(c);
+        }
+        extend_kmeans_plus_plus(seed_state, chosen, k, cost, rng);
+        return chosen;
+    }
+
+    // Weight each candidate by how many points it is nearest to.
+    std::vector<double> cand_x(candidates.size()), cand_y(candidates.size());
+    for (size_t c = 0; c < candidates.size(); ++c) {
+        cand_x[c] = candidates[c].x;
+        cand_y[c] = candidates[c].y;
+    }
+    std::vector<int> nearest(n);
+    std::vector<std::vector<uint32_t>> chunk_weights(num_chunks);
+    for_each_chunk(n, [&](size_t chunk, size_t begin, size_t end) {
+        assign_columns(assign_kernel, column_x + begin, column_y + begin, end - begin,
+                       cand_x.data(), cand_y.data(), candidates.size(), nearest.data() + begin);
+        chunk_weights[chunk].assign(candidates.size(), 0);
+        for (size_t i = begin; i < end; ++i) chunk_weights[chunk][nearest[i]]++;
+    });
+    distances_computed += (uint64_t)n * candidates.size();
+
+    std::vector<double> weight(candidates.size(), 0.0);
+    for (const auto& chunk : chunk_weights) {
+        for (size_t c = 0; c < candidates.size(); ++c) weight[c] += chunk[c];
+    }
+
+    // Weighted k-means++ over the candidates.
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    std::vector<double> cand_d2(candidates.size(), std::numeric_limits<double>::infinity());
+    std::vector<Centroid> chosen;
+    auto add = [&](size_t c) {
+        chosen.push_back(candidates[c]);
+        for (size_t j = 0; j < candidates.size(); ++j) {
+            double dx = cand_x[j] - candidates[c].x;
+            double dy = cand_y[j] - candidates[c].y;
+            cand_d2[j] = std::min(cand_d2[j], dx * dx + dy * dy);
+        }
+    };
+    std::discrete_distribution<size_t> by_weight(weight.begin(), weight.end());
+    add(by_weight(rng));
+    while (chosen.size() < k) {
+        double total = 0.0;
+        for (size_t j = 0; j < candidates.size(); ++j) total += weight[j] * cand_d2[j];
+        if (total <= 0.0) {
+            add(std::uniform_int_distribution<size_t>(0, candidates.size() - 1)(rng));
+            continue;
+        }
+        double target = unit(rng) * total;
+        size_t next = candidates.size() - 1;
+        for (size_t j = 0; j < candidates.size(); ++j) {
+            double w = weight[j] * cand_d2[j];
+            if (target < w) { next = j; break; }
+            target -= w;
+        }
+        add(next);
+    }
+    return chosen;
+}
+
+// Replaces the loaded centroids according to init_mode; k == 0 keeps the
+// current centroid count.
+void seed_centroids(InitMode mode, size_t k, uint64_t seed) {
+    reseed_rng.seed(seed);
+    init_seconds = 0.0;
+    if (mode == InitMode::File || column_size == 0) return;
+    auto start = std::chrono::steady_clock::now();
+    if (k == 0) k = centroids.size();
+    if (k == 0) return;
+    k = std::min(k, column_size);
+
+    std::mt19937_64 rng(seed);
+    centroids = mode == InitMode::KMeansPlusPlus ? seed_kmeans_plus_plus(k, rng, seed_state)
+                                                 : seed_kmeans_parallel(k, rng, seed);
+    seed_state = SeedState();
+    for (auto& p : points) p.cluster = -1;
+    history.clear();
+    mark_points_changed();
+    init_seconds = seconds_since(start);
+}
+
+// The `limit` points farthest from their centroid in the just-updated
+// `centroids`, farthest first.
+static std::vector<size_t> farthest_points(size_t limit) {
+    std::vector<std::pair<double, size_t>> worst;
+    for (size_t i = 0; i < column_size; ++i) {
+        int c = points[i].cluster;
+        if (c < 0) continue;
+        double dx = column_x[i] - centroids[c].x;
+        double dy = column_y[i] - centroids[c].y;
+        worst.emplace_back(dx * dx + dy * dy, i);
+        std::push_heap(worst.begin(), worst.end(), std::greater<std::pair<double, size_t>>());
+        if (worst.size() > limit) {
+            std::pop_heap(worst.begin(), worst.end(), std::greater<std::pair<double, size_t>>());
+            worst.pop_back();
+        }
+    }
+    std::sort(worst.rbegin(), worst.rend());
+    std::vector<size_t> order;
+    for (const auto& w : worst) order.push_back(w.second);
+    return order;
+}
+
+// Moves the centroids of empty clusters according to empty_policy. A target
+// whose coordinates already hold a centroid (or another target) is skipped:
+// two centroids on one spot leave one of them empty for good, and the run
+// would reseed it every iteration until max_iterations. Returns true if any
+// centroid was moved.
+bool reseed_empty_clusters(const std::vector<int>& count) {
+    if (empty_policy == EmptyPolicy::Keep || column_size == 0) return false;
+
+    std::vector<size_t> empty;
+    for (size_t c = 0; c < count.size(); ++c) {
+        if (count[c] == 0) empty.push_back(c);
+    }
+    if (empty.empty()) return false;
+
+    std::set<std::pair<double, double>> occupied;
+    for (const auto& c : centroids) occupied.insert({ c.x, c.y });
+    std::set<std::pair<double, double>> taken = occupied;
+    std::vector<size_t> targets;
+    auto offer = [&](size_t i) {
+        if (taken.insert({ column_x[i], column_y[i] }).second) targets.push_back(i);
+    };
+
+    if (empty_policy == EmptyPolicy::Random) {
+        // Bounded, so data that only has the centroids' coordinates still stops.
+        std::uniform_int_distribution<size_t> pick(0, column_size - 1);
+        for (size_t tries = 0; targets.size() < empty.size() && tries < 8 * empty.size(); ++tries) {
+            offer(pick(reseed_rng));
+        }
+    } else {
+        // Widen the search while duplicates crowd out the farthest points.
+        for (size_t limit = empty.size(); ; limit *= 2) {
+            targets.clear();
+            taken = occupied;
+            std::vector<size_t> order = farthest_points(limit);
+            for (size_t j = 0; j < order.size() && targets.size() < empty.size(); ++j) offer(order[j]);
+            if (targets.size() == empty.size() || order.size() < limit) break;
+        }
+    }
+
+    for (size_t j = 0; j < targets.size(); ++j) {
+        centroids[empty[j]] = centroid_at(targets[j]);
+    }
+    empty_reseeds += targets.size();
+    return !targets.empty();
+}
+
+// ---- Profiling ----
+// Per-phase timers for the k-means thread (history, assign, update, log,
+// publish) and the renderer (draw). Each phase keeps its last, total and
+// worst time plus a histogram with one bucket per power of two microseconds,
+// which gives rough percentiles without storing samples. Each iteration also
+// counts reassigned points, distances computed and bytes added to the
+// history; --profile=FILE appends those and the phase times as one JSON line
+// per iteration. The k-means thread owns `profile`; the renderer sees it
+// through the published frame and keeps its own draw timings.
+
+enum class Phase { History, Assign, Update, Log, Publish, Draw, Count };
+
+const size_t NUM_PHASES = (size_t)Phase::Count;
+
+const char* phase_name(Phase phase) {
+    switch (phase) {
+        case Phase::History: return "history";
+        case Phase::Assign: return "assign";
+        case Phase::Update: return "update";
+        case Phase::Log: return "log";
+        case Phase::Publish: return "publish";
+        case Phase::Draw: return "draw";
+        default: return "unknown";
+    }
+}
+
+struct PhaseStats {
+    static const int BUCKETS = 32;      // bucket b: [2^(b-1), 2^b) us, bucket 0: < 1 us
+    uint64_t samples = 0;
+    double last = 0.0, total = 0.0, max = 0.0;
+    uint32_t histogram[BUCKETS] = {};
+
+    void add(double seconds) {
+        samples++;
+        last = seconds;
+        total += seconds;
+        max = std::max(max, seconds);
+        int bucket = 0;
+        for (double us = seconds * 1e6; us >= 1.0 && bucket < BUCKETS - 1; us *= 0.5) {
+            bucket++;
+        }
+        histogram[bucket]++;
+    }
+
+    double mean() const { return samples ? total / samples : 0.0; }
+
+    // Upper edge of the bucket holding quantile q, in seconds.
+    double quantile(double q) const {
+        uint64_t seen = 0;
+        for (int b = 0; b < BUCKETS; ++b) {
+            seen += histogram[b];
+            if (seen > 0 && seen >= q * samples) return std::ldexp(1e-6, b);
+        }
+        return max;
+    }
+};
+
+struct ProfileCounters {
+    uint64_t reassigned = 0;
+    uint64_t distances = 0;
+    uint64_t history_bytes = 0;
+};
+
+struct ProfileSummary {
+    PhaseStats phases[NUM_PHASES];
+    uint64_t iterations = 0;
+    ProfileCounters last, total;
+
+    PhaseStats& operator[](Phase phase) { return phases[(size_t)phase]; }
+    const PhaseStats& operator[](Phase phase) const { return phases[(size_t)phase]; }
+};
+
+ProfileSummary profile;
+std::ofstream profile_out;
+std::atomic<uint64_t> draw_frames(0);
+std::atomic<uint64_t> draw_nanoseconds(0);
+
+// Closes an iteration: adds the counters and writes the JSON line.
+void finish_iteration_profile(const ProfileCounters& counters) {
+    profile.iterations++;
+    profile.last = counters;
+    profile.total.reassigned += counters.reassigned;
+    profile.total.distances += counters.distances;
+    profile.total.history_bytes += counters.history_bytes;
+    if (!profile_out.is_open()) return;
+
+    profile_out << std::setprecision(6) << std::defaultfloat
+                << "{\"iteration\":" << profile.iterations;
+    for (Phase phase : { Phase::History, Phase::Assign, Phase::Update }) {
+        profile_out << ",\"" << phase_name(phase) << "\":" << profile[phase].last;
+    }
+    profile_out << ",\"reassigned\":" << counters.reassigned
+                << ",\"distances\":" << counters.distances
+                << ",\"history_bytes\":" << counters.history_bytes
+                << ",\"history_total_bytes\":" << history.bytes()
+                << ",\"publish_seconds\":" << profile[Phase::Publish].total
+                << ",\"log_seconds\":" << profile[Phase::Log].total
+                << ",\"draw_frames\":" << draw_frames
+                << ",\"draw_seconds\":" << draw_nanoseconds * 1e-9
+                << "}\n";
+}
+
+// ---- Iteration logging ----
+// Replaces the old print-everything dump. The compute thread only copies what
+// the chosen mode needs into a LogRecord and queues it; a writer thread does
+// the formatting into its own batch buffer and hands it to stdio in large
+// fwrite calls, so stdout needs no setvbuf. The GUI logs a summary every
+// iteration unless --log says otherwise; headless runs log nothing. The queue is
+// bounded: when the writer falls behind, records are dropped (and counted)
+// rather than stalling the clustering.
+//
+//   summary  centroids and cluster sizes
+//   sample   summary plus a fixed, evenly spaced subset of points
+//   full     summary plus every point (the old print_iteration output)
+//   binary   compact trace, one record per iteration:
+//              uint32 iteration, uint32 k, uint64 n, uint32 label_width, uint32 0,
+//              k x (double x, double y), n labels stored as label + 1 in
+//              label_width (1, 2 or 4) little-endian bytes
+//            after a 16-byte file header "KMTR", uint32 version 1, 8 zero bytes.
+
+enum class LogMode { Off, Summary, Sample, Full, Binary };
+
+const size_t LOG_QUEUE_LIMIT = 256u << 20;    // bytes of queued records
+const size_t LOG_BATCH_BYTES = 4u << 20;     // formatted output collected per fwrite
+
+LogMode log_mode = LogMode::Off;
+
+// Point count per cluster as of the last kmeans_iteration, valid while
+// points_version still equals cluster_sizes_version. Saves the logger a pass.
+std::vector<int> cluster_sizes;
+uint64_t cluster_sizes_version = UINT64_MAX;
+
+const char* log_mode_name(LogMode mode) {
+    switch (mode) {
+        case LogMode::Off: return "off";
+        case LogMode::Summary: return "summary";
+        case LogMode::Sample: return "sample";
+        case LogMode::Full: return "full";
+        case LogMode::Binary: return "binary";
+    }
+    return "unknown";
+}
+
+struct LogRecord {
+    int iteration = 0;
+    size_t num_points = 0;
+    std::vector<Centroid> centroids;
+    std::vector<int> sizes;
+    std::vector<uint32_t> point_index;      // sample/full: which points, 0-based
+    std::vector<Point> sampled;             // sample/full: the points at log time
+    uint32_t label_width = 0;               // binary only
+    std::vector<uint8_t> labels;
+
+    size_t bytes() const {
+        return sizeof(LogRecord) + centroids.size() * sizeof(Centroid) + sizes.size() * sizeof(int) +
+               point_index.size() * sizeof(uint32_t) + sampled.size() * sizeof(Point) + labels.size();
+    }
+};
+
+class IterationLogger {
+public:
+    ~IterationLogger() { stop(); }
+
+    // path "-" is stdout, "" is stderr.
+    bool start(LogMode log_mode, const std::string& path, size_t sample_points) {
+        mode = log_mode;
+        sample = std::max<size_t>(1, sample_points);
+        if (mode == LogMode::Off) return true;
+
+        if (path == "-") {
+            out = stdout;
+        } else if (path.empty()) {
+            out = stderr;
+        } else {
+            out = fopen(path.c_str(), mode == LogMode::Binary ? "wb" : "w");
+            if (!out) {
+                std::cerr << "Cannot open log file '" << path << "'" << std::endl;
+                return false;
+            }
+            owns_file = true;
+        }
+        batch.reserve(LOG_BATCH_BYTES);
+
+        if (mode == LogMode::Binary) {
+            const char magic[4] = { 'K', 'M', 'T', 'R' };
+            const uint32_t header[3] = { 1, 0, 0 };
+            append_raw(magic, sizeof(magic));
+            append_raw(header, sizeof(header));
+        }
+        running = true;
+        writer = std::thread(&IterationLogger::writer_loop, this);
+        return true;
+    }
+
+    bool enabled() const { return mode != LogMode::Off; }
+
+    // Called by the compute thread after an iteration; never waits for I/O.
+    void log(int iteration) {
+        if (mode == LogMode::Off) return;
+
+        LogRecord record;
+        record.iteration = iteration;
+        record.num_points = points.size();
+        record.centroids = centroids;
+        const size_t k = centroids.size();
+
+        if (mode == LogMode::Binary) {
+            record.label_width = k <= 0xff ? 1 : k <= 0xffff ? 2 : 4;
+            record.labels.resize(points.size() * record.label_width);
+            uint8_t* data = record.labels.data();
+            for (size_t i = 0; i < points.size(); ++i) {
+                uint32_t value = (uint32_t)(points[i].cluster + 1);
+                memcpy(data + i * record.label_width, &value, record.label_width);
+            }
+        } else {
+            if (cluster_sizes.size() == k && cluster_sizes_version == points_version) {
+                record.sizes = cluster_sizes;
+            } else {
+                record.sizes.assign(k, 0);
+                for (const auto& point : points) {
+                    if (point.cluster >= 0 && (size_t)point.cluster < k) record.sizes[point.cluster]++;
+                }
+            }
+            if (mode != LogMode::Summary) {
+                const size_t stride = mode == LogMode::Full ? 1 : std::max<size_t>(1, (points.size() + sample - 1) / sample);
+                for (size_t i = 0; i < points.size(); i += stride) {
+                    record.point_index.push_back(i);
+                    record.sampled.push_back(points[i]);
+                }
+            }
+        }
+
+        const size_t bytes = record.bytes();
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!running) return;
+        if (queued_bytes + bytes > LOG_QUEUE_LIMIT) {
+            dropped++;
+            return;
+        }
+        queued_bytes += bytes;
+        queue.push_back(std::move(record));
+        ready.notify_one();
+    }
+
+    // Drains the queue and closes the file.
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!running) return;
+            running = false;
+        }
+        ready.notify_one();
+        writer.join();
+
+        flush_batch();
+        if (owns_file) {
+            fclose(out);
+        } else {
+            fflush(out);
+        }
+        out = nullptr;
+        if (dropped) {
+            std::cerr << "Log writer fell behind: " << dropped << " iteration record(s) dropped" << std::endl;
+        }
+    }
+
+private:
+    void writer_loop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            ready.wait(lock, [&] { return !queue.empty() || !running; });
+            if (queue.empty()) return;
+
+            LogRecord record = std::move(queue.front());
+            queue.pop_front();
+            queued_bytes -= record.bytes();
+            lock.unlock();
+            if (mode == LogMode::Binary) {
+                write_binary(record);
+            } else {
+                write_text(record);
+            }
+            lock.lock();
+            // Caught up: hand the batch over so the output keeps pace with the run
+            if (queue.empty() || batch.size() >= LOG_BATCH_BYTES) {
+                lock.unlock();
+                flush_batch();
+                lock.lock();
+            }
+        }
+    }
+
+    void flush_batch() {
+        if (batch.empty()) return;
+        fwrite(batch.data(), 1, batch.size(), out);
+        fflush(out);
+        batch.clear();
+    }
+
+    void append_raw(const void* data, size_t length) {
+        batch.append((const char*)data, length);
+    }
+
+    __attribute__((format(printf, 2, 3)))
+    void append(const char* format, ...) {
+        char line[256];
+        va_list args;
+        va_start(args, format);
+        const int length = vsnprintf(line, sizeof(line), format, args);
+        va_end(args);
+        if (length < 0) return;
+        if ((size_t)length < sizeof(line)) {
+            batch.append(line, length);
+            return;
+        }
+        const size_t at = batch.size();
+        batch.resize(at + length + 1);
+        va_start(args, format);
+        vsnprintf(&batch[at], length + 1, format, args);
+        va_end(args);
+        batch.resize(at + length);
+    }
+
+    void write_text(const LogRecord& record) {
+        append("\n=== Iteration %d ===\nNumber of centroids: %zu\n", record.iteration, record.centroids.size());
+        for (size_t i = 0; i < record.centroids.size(); ++i) {
+            append("Centroid %zu: (%.2f, %.2f) -> Points in cluster: %d\n", i + 1,
+                    record.centroids[i].x, record.centroids[i].y, record.sizes[i]);
+        }
+        if (mode == LogMode::Summary) return;
+
+        if (mode == LogMode::Sample) {
+            append("\nSampled points (%zu of %zu):\n", record.sampled.size(), record.num_points);
+        } else {
+            append("\nPoint Assignments:\n");
+        }
+        for (size_t j = 0; j < record.sampled.size(); ++j) {
+            const Point& p = record.sampled[j];
+            append("Point %u: (%.2f, %.2f) -> Cluster %d\n", record.point_index[j] + 1, p.x, p.y, p.cluster + 1);
+        }
+    }
+
+    void write_binary(const LogRecord& record) {
+        const uint32_t head[2] = { (uint32_t)record.iteration, (uint32_t)record.centroids.size() };
+        const uint64_t n = record.num_points;
+        const uint32_t tail[2] = { record.label_width, 0 };
+        append_raw(head, sizeof(head));
+        append_raw(&n, sizeof(n));
+        append_raw(tail, sizeof(tail));
+        for (const auto& c : record.centroids) {
+            const double xy[2] = { c.x, c.y };
+            append_raw(xy, sizeof(xy));
+        }
+        append_raw(record.labels.data(), record.labels.size());
+    }
+
+    LogMode mode = LogMode::Off;
+    size_t sample = 1000;
+    FILE* out = nullptr;
+    bool owns_file = false;
+    std::string batch;                      // writer thread only, until stop() joins it
+    std::thread writer;
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<LogRecord> queue;
+    size_t queued_bytes = 0;
+    bool running = false;
+    uint64_t dropped = 0;
+};
+
+IterationLogger iteration_logger;
+
+// Logs the state after `iteration` and charges the copy to the log phase.
+void log_iteration(int iteration) {
+    if (!iteration_logger.enabled()) return;
+    auto start = std::chrono::steady_clock::now();
+    iteration_logger.log(iteration);
+    profile[Phase::Log].add(seconds_since(start));
+}
+
+// Accumulated wall time of each kmeans_iteration() phase, in seconds. In the
+// parallel mode the partial sums are built during assignment, so "assign"
+// includes them and "update" is only the reduction result turned into means.
+struct PhaseTimes {
+    double history = 0.0;
+    double assign = 0.0;
+    double update = 0.0;
+};
+
+PhaseTimes phase_times;
+bool record_history = true;
+
+// Centroid update strategy. Full re-sums every point after assignment. Incremental
+// keeps the per-cluster sums between iterations and only moves the points that
+// changed cluster from their old sums to their new ones, which skips a whole
+// pass over the points once few of them move. The running sums pick up
+// rounding error with every add/subtract pair, so they are rebuilt from
+// scratch every resum_interval iterations. They are also rebuilt whenever the
+// labels were changed outside kmeans_iteration (points_version moved on).
+
+enum class UpdateMode { Full, Incremental };
+
+UpdateMode update_mode = UpdateMode::Full;
+
+struct ClusterSums {
+    std::vector<double> sum_x, sum_y;
+    std::vector<int> count;
+    size_t num_points = 0;
+    uint64_t version = UINT64_MAX;  // points_version the sums match
+    int since_resum = 0;
+    int resum_interval = 32;
+
+    bool usable(size_t k, size_t n, uint64_t current_version) const {
+        return count.size() == k && num_points == n && version == current_version &&
+               since_resum < resum_interval;
+    }
+};
+
+ClusterSums cluster_sums;
+
+bool kmeans_iteration() {
+    bool changed = false;
+    size_t reassigned = 0;
+    const size_t num_centroids = centroids.size();
+    const uint64_t distances_before = distances_computed;
+    const size_t history_before = history.bytes();
+
+    auto phase_start = std::chrono::steady_clock::now();
+    if (record_history) {
+        history.push(points, centroids);
+    }
+    double elapsed = seconds_since(phase_start);
+    phase_times.history += elapsed;
+    profile[Phase::History].add(elapsed);
+
+    phase_start = std::chrono::steady_clock::now();
+    if (column_size != points.size()) {
+        sync_point_columns();
+    }
+    sync_centroid_columns();
+    if (prune_mode == PruneMode::Hamerly) {
+        hamerly_prepare();
+    } else {
+        prepare_centroid_index();
+        prepare_reduced_precision();
+    }
+
+    const bool incremental = update_mode == UpdateMode::Incremental &&
+                             cluster_sums.usable(num_centroids, points.size(), points_version);
+    std::vector<double> full_x, full_y;
+    std::vector<int> full_count;
+    if (!incremental) {
+        full_x.assign(num_centroids, 0.0);
+        full_y.assign(num_centroids, 0.0);
+        full_count.assign(num_centroids, 0);
+    }
+    std::vector<double>& sum_x = incremental ? cluster_sums.sum_x : full_x;
+    std::vector<double>& sum_y = incremental ? cluster_sums.sum_y : full_y;
+    std::vector<int>& count = incremental ? cluster_sums.count : full_count;
+
+    if (worker_pool) {
+        reassigned = parallel_assign_and_sum(sum_x, sum_y, count, incremental);
+        elapsed = seconds_since(phase_start);
+        phase_start = std::chrono::steady_clock::now();
+    } else {
+        nearest_cluster.resize(points.size());
+        assign_points(0, points.size());
+
+        for (size_t i = 0; i < points.size(); ++i) {
+            const int previous = points[i].cluster;
+            const int cluster = nearest_cluster[i];
+            if (previous == cluster) continue;
+            points[i].cluster = cluster;
+            reassigned++;
+            if (!incremental) continue;
+            if (previous >= 0) {
+                sum_x[previous] -= column_x[i];
+                sum_y[previous] -= column_y[i];
+                count[previous]--;
+            }
+            if (cluster >= 0) {
+                sum_x[cluster] += column_x[i];
+                sum_y[cluster] += column_y[i];
+                count[cluster]++;
+            }
+        }
+        elapsed = seconds_since(phase_start);
+        phase_start = std::chrono::steady_clock::now();
+
+        if (!incremental) {
+            // Every label now equals nearest_cluster, so the core can sum straight from it.
+            kmeans::Sums sums;
+            sums.reset(num_centroids, 2);
+            kmeans::accumulate_range(point_view(), nearest_cluster.data(), 0, column_size, sums);
+            for (size_t c = 0; c < num_centroids; ++c) {
+                sum_x[c] = sums.coords[2 * c];
+                sum_y[c] = sums.coords[2 * c + 1];
+                count[c] = (int)sums.count[c];
+            }
+        }
+    }
+    phase_times.assign += elapsed;
+    profile[Phase::Assign].add(elapsed);
+    changed = reassigned > 0;
+
+    for (size_t i = 0; i < num_centroids; ++i) {
+        if (count[i] > 0) {
+            centroids[i].x = sum_x[i] / count[i];
+            centroids[i].y = sum_y[i] / count[i];
+        }
+    }
+    if (reseed_empty_clusters(count)) {
+        changed = true;
+    }
+    elapsed = seconds_since(phase_start);
+    phase_times.update += elapsed;
+    profile[Phase::Update].add(elapsed);
+
+    cluster_sizes = count;
+    if (update_mode == UpdateMode::Incremental) {
+        if (incremental) {
+            cluster_sums.since_resum++;
+        } else {
+            cluster_sums.sum_x.swap(full_x);
+            cluster_sums.sum_y.swap(full_y);
+            cluster_sums.count.swap(full_count);
+            cluster_sums.num_points = points.size();
+            cluster_sums.since_resum = 0;
+        }
+    }
+
+    ProfileCounters counters;
+    counters.reassigned = reassigned;
+    counters.distances = distances_computed - distances_before;
+    counters.history_bytes = history.bytes() > history_before ? history.bytes() - history_before : 0;
+    finish_iteration_profile(counters);
+
+    if (changed) {
+        mark_points_changed();
+    }
+    cluster_sums.version = points_version;
+    cluster_sizes_version = points_version;
+    return changed;
+}
+
+// ---- Point files ----
+// Text files keep the original layout: a point count, that many "x y" pairs,
+// a centroid count and that many "x y" pairs, separated by any whitespace.
+// They are mapped and parsed in parallel straight into the coordinate columns.
+//
+// Binary files (written by --convert) start with a PointFileHeader followed by
+// planar columns: x[0..N), y[0..N), then the centroids cx[0..K), cy[0..K).
+// float64 files are used in place: the engine reads the mapped columns.
+
+struct PointFileHeader {
+    char magic[4];          // "KMPT"
+    uint32_t version;       // 1
+    uint64_t num_points;
+    uint64_t num_centroids;
+    uint32_t dimension;     // 2
+    uint32_t dtype;         // POINT_DTYPE_*
+    uint64_t data_offset;   // byte offset of the first column
+    uint8_t reserved[24];
+};
+
+static_assert(sizeof(PointFileHeader) == 64, "point file header must stay 64 bytes");
+
+const char POINT_FILE_MAGIC[4] = { 'K', 'M', 'P', 'T' };
+const uint32_t POINT_DTYPE_FLOAT64 = 0;
+const uint32_t POINT_DTYPE_FLOAT32 = 1;
+
+void close_mapped_points() {
+    if (mapped_points.base) {
+        munmap(mapped_points.base, mapped_points.length);
+    }
+    mapped_points = MappedPoints();
+}
+
+static bool is_space(char ch) {
+    return ch == ' ' || ch == '\n' || ch == '\t' || ch == '\r' || ch == '\v' || ch == '\f';
+}
+
+static const char* skip_space(const char* p, const char* end) {
+    while (p < end && is_space(*p)) p++;
+    return p;
+}
+
+// Parses the number starting at p (which must not be whitespace) and returns
+// the position just past the token.
+static const char* parse_token(const char* p, const char* end, double& value, bool& ok) {
+    const char* token_end = p;
+    while (token_end < end && !is_space(*token_end)) token_end++;
+    const char* start = (*p == '+') ? p + 1 : p;
+    auto result = std::from_chars(start, token_end, value);
+    ok = result.ec == std::errc() && result.ptr == token_end;
+    return token_end;
+}
+
+static void finish_loading(size_t num_points) {
+    points.resize(num_points);
+    auto fill = [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            points[i].x = column_x[i];
+            points[i].y = column_y[i];
+            points[i].cluster = -1;
+        }
+    };
+    if (worker_pool) {
+        const size_t num_chunks = (num_points + PARALLEL_CHUNK_SIZE - 1) / PARALLEL_CHUNK_SIZE;
+        worker_pool->parallel_for(num_chunks, [&](size_t chunk) {
+            const size_t begin = chunk * PARALLEL_CHUNK_SIZE;
+            fill(begin, std::min(num_points, begin + PARALLEL_CHUNK_SIZE));
+        });
+    } else {
+        fill(0, num_points);
+    }
+
+    if (record_history) {
+        history.push(points, centroids);
+    }
+}
+
+static bool load_binary_points(void* base, size_t length) {
+    PointFileHeader header;
+    if (length < sizeof(header)) return false;
+    memcpy(&header, base, sizeof(header));
+
+    const size_t elem = header.dtype == POINT_DTYPE_FLOAT64 ? sizeof(double)
+                      : header.dtype == POINT_DTYPE_FLOAT32 ? sizeof(float) : 0;
+    if (header.dimension != 2) {
+        std::cerr << "Point file has dimension " << header.dimension
+                  << "; only 2-D files can be visualised (use --headless)" << std::endl;
+        return false;
+    }
+    if (header.version != 1 || elem == 0 ||
+        header.data_offset % elem != 0 || header.data_offset < sizeof(header) ||
+        header.data_offset > length ||
+        (length - header.data_offset) / (2 * elem) < header.num_points + header.num_centroids) {
+        std::cerr << "Unsupported or truncated point file" << std::endl;
+        return false;
+    }
+
+    const size_t n = header.num_points;
+    const size_t k = header.num_centroids;
+    const char* data = (const char*)base + header.data_offset;
+
+    centroids.resize(k);
+    if (header.dtype == POINT_DTYPE_FLOAT64) {
+        const double* column = (const double*)data;
+        for (size_t i = 0; i < k; ++i) {
+            centroids[i].x = column[2 * n + i];
+            centroids[i].y = column[2 * n + k + i];
+        }
+        mapped_points.base = base;
+        mapped_points.length = length;
+        mapped_points.xs = column;
+        mapped_points.count = n;
+        use_point_columns(mapped_points.xs, n);
+    } else {
+        const float* column = (const float*)data;
+        for (size_t i = 0; i < k; ++i) {
+            centroids[i].x = column[2 * n + i];
+            centroids[i].y = column[2 * n + k + i];
+        }
+        point_columns.assign(column, column + 2 * n);
+        use_point_columns(point_columns.data(), n);
+        munmap(base, length);
+    }
+    finish_loading(n);
+    return true;
+}
+
+// Two passes over the mapped text: count the tokens in each slice, then parse
+// every slice in parallel into its precomputed position in the columns.
+static bool load_text_points(const char* data, size_t length) {
+    const char* end = data + length;
+    const char* p = skip_space(data, end);
+    if (p == end) return false;
+
+    double header_value;
+    bool ok;
+    const char* body = parse_token(p, end, header_value, ok);
+    if (!ok || header_value < 0) return false;
+    size_t num_points = (size_t)header_value;
+
+    std::unique_ptr<WorkerPool> local_pool;
+    WorkerPool* pool = worker_pool.get();
+    if (!pool) {
+        local_pool.reset(new WorkerPool(std::max(1u, std::thread::hardware_concurrency())));
+        pool = local_pool.get();
+    }
+
+    const size_t body_length = end - body;
+    const size_t min_slice = 1 << 20;
+    const size_t num_slices = std::max<size_t>(1, std::min<size_t>(pool->size() * 4, body_length / min_slice));
+
+    // Slice boundaries are moved forward onto whitespace so no token is split.
+    std::vector<const char*> bounds(num_slices + 1);
+    bounds[0] = body;
+    bounds[num_slices] = end;
+    for (size_t i = 1; i < num_slices; ++i) {
+        const char* b = body + body_length * i / num_slices;
+        while (b < end && !is_space(*b)) b++;
+        bounds[i] = std::max(b, bounds[i - 1]);
+    }
+
+    std::vector<size_t> token_counts(num_slices + 1, 0);
+    pool->parallel_for(num_slices, [&](size_t slice) {
+        size_t count = 0;
+        bool in_token = false;
+        for (const char* q = bounds[slice]; q < bounds[slice + 1]; ++q) {
+            bool token_char = !is_space(*q);
+            count += token_char && !in_token;
+            in_token = token_char;
+        }
+        token_counts[slice + 1] = count;
+    });
+    for (size_t i = 1; i <= num_slices; ++i) {
+        token_counts[i] += token_counts[i - 1];
+    }
+
+    // Tokens after the header: 2 * num_points coordinates, then the centroid block.
+    num_points = std::min(num_points, token_counts[num_slices] / 2);
+    const size_t coordinate_tokens = 2 * num_points;
+
+    point_columns.resize(2 * num_points);
+    std::atomic<bool> parse_failed(false);
+    std::atomic<const char*> centroid_block(nullptr);
+
+    pool->parallel_for(num_slices, [&](size_t slice) {
+        size_t token = token_counts[slice];
+        const char* q = skip_space(bounds[slice], bounds[slice + 1]);
+        while (q < bounds[slice + 1] && token < coordinate_tokens) {
+            double value;
+            bool token_ok;
+            q = parse_token(q, end, value, token_ok);
+            if (!token_ok) parse_failed = true;
+            point_columns[(token % 2) * num_points + token / 2] = value;
+            token++;
+            q = skip_space(q, bounds[slice + 1]);
+        }
+        if (token == coordinate_tokens && q < bounds[slice + 1]) {
+            centroid_block = q;
+        }
+    });
+    if (parse_failed) {
+        std::cerr << "Malformed number in point file" << std::endl;
+        return false;
+    }
+
+    // The centroid block is tiny; read it serially.
+    centroids.clear();
+    const char* q = centroid_block.load();
+    if (q) {
+        double count_value;
+        q = parse_token(q, end, count_value, ok);
+        size_t num_centroids = ok && count_value > 0 ? (size_t)count_value : 0;
+        for (size_t i = 0; i < num_centroids; ++i) {
+            Centroid c;
+            q = skip_space(q, end);
+            if (q == end) break;
+            q = parse_token(q, end, c.x, ok);
+            if (!ok) break;
+            q = skip_space(q, end);
+            if (q == end) break;
+            q = parse_token(q, end, c.y, ok);
+            if (!ok) break;
+            centroids.push_back(c);
+        }
+    }
+
+    use_point_columns(point_columns.data(), num_points);
+    finish_loading(num_points);
+    return true;
+}
+
+void read_from_file(const std::string& file_name) {
+    close_mapped_points();
+    points.clear();
+    centroids.clear();
+    history.clear();
+
+    int fd = open(file_name.c_str(), O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0 || info.st_size == 0) {
+        if (fd >= 0) close(fd);
+        std::cerr << "Error opening file!" << std::endl;
+        return;
+    }
+
+    const size_t length = info.st_size;
+    void* base = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        std::cerr << "Error opening file!" << std::endl;
+        return;
+    }
+    madvise(base, length, MADV_SEQUENTIAL);
+
+    if (length >= sizeof(POINT_FILE_MAGIC) && memcmp(base, POINT_FILE_MAGIC, sizeof(POINT_FILE_MAGIC)) == 0) {
+        // On success the loader keeps (float64) or releases (float32) the mapping.
+        if (!load_binary_points(base, length)) {
+            munmap(base, length);
+            points.clear();
+            centroids.clear();
+        }
+        return;
+    }
+
+    if (!load_text_points((const char*)base, length)) {
+        std::cerr << "Error reading " << file_name << std::endl;
+        points.clear();
+        centroids.clear();
+        use_point_columns(nullptr, 0);
+    }
+    munmap(base, length);
+}
+
+bool write_binary_file(const std::string& file_name, uint32_t dtype) {
+    std::ofstream file(file_name, std::ios::binary);
+    if (!file) {
+        std::cerr << "Error writing " << file_name << std::endl;
+        return false;
+    }
+
+    PointFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, POINT_FILE_MAGIC, sizeof(header.magic));
+    header.version = 1;
+    header.num_points = points.size();
+    header.num_centroids = centroids.size();
+    header.dimension = 2;
+    header.dtype = dtype;
+    header.data_offset = sizeof(header);
+    file.write((const char*)&header, sizeof(header));
+
+    // Columns are written through a small staging block in the target dtype.
+    std::vector<double> wide;
+    std::vector<float> narrow;
+    auto write_column = [&](size_t count, const std::function<double(size_t)>& get) {
+        const size_t block = 1 << 16;
+        for (size_t start = 0; start < count; start += block) {
+            size_t len = std::min(block, count - start);
+            if (dtype == POINT_DTYPE_FLOAT64) {
+                wide.resize(len);
+                for (size_t i = 0; i < len; ++i) wide[i] = get(start + i);
+                file.write((const char*)wide.data(), len * sizeof(double));
+            } else {
+                narrow.resize(len);
+                for (size_t i = 0; i < len; ++i) narrow[i] = (float)get(start + i);
+                file.write((const char*)narrow.data(), len * sizeof(float));
+            }
+        }
+    };
+    write_column(points.size(), [&](size_t i) { return points[i].x; });
+    write_column(points.size(), [&](size_t i) { return points[i].y; });
+    write_column(centroids.size(), [&](size_t i) { return centroids[i].x; });
+    write_column(centroids.size(), [&](size_t i) { return centroids[i].y; });
+    return bool(file);
+}
+
+// --convert: loads a point file (text or binary) and writes it in binary form.
+int run_convert(const std::string& input, const std::string& output, uint32_t dtype) {
+    auto start = std::chrono::steady_clock::now();
+    record_history = false;
+    read_from_file(input);
+    if (points.empty() && centroids.empty()) {
+        return 1;
+    }
+    const double load_seconds = seconds_since(start);
+
+    start = std::chrono::steady_clock::now();
+    if (!write_binary_file(output, dtype)) {
+        return 1;
+    }
+    std::cout << "Converted " << points.size() << " points and " << centroids.size()
+              << " centroids to " << output << " ("
+              << (dtype == POINT_DTYPE_FLOAT64 ? "float64" : "float32") << "); load "
+              << std::fixed << std::setprecision(3) << load_seconds << " s, write "
+              << seconds_since(start) << " s" << std::endl;
+    return 0;
+}
+
+// ---- Mini-batch streaming ----
+// Mini-batch k-means (Sculley 2010). The input file is read a fixed number of
+// points at a time into `points`, which is reused for every batch, so memory
+// is bounded by the batch size however large the file is. Each centroid moves
+// toward its newly assigned points with a per-centroid learning rate of
+// 1 / (points it has absorbed so far).
+
+class PointStream {
+public:
+    bool open(const std::string& file_name) {
+        file.close();
+        file.clear();
+        file.open(file_name);
+        if (!file || !(file >> total_points) || total_points < 0) {
+            return false;
+        }
+        data_start = file.tellg();
+        remaining = total_points;
+        return true;
+    }
+
+    void rewind() {
+        file.clear();
+        file.seekg(data_start);
+        remaining = total_points;
+    }
+
+    // Replaces the contents of batch with up to max_points points.
+    size_t read_batch(std::vector<Point>& batch, size_t max_points) {
+        batch.clear();
+        while (remaining > 0 && batch.size() < max_points) {
+            Point p;
+            if (!(file >> p.x >> p.y)) {
+                remaining = 0;
+                break;
+            }
+            remaining--;
+            batch.push_back(p);
+        }
+        return batch.size();
+    }
+
+    long long total() const { return total_points; }
+
+private:
+    std::ifstream file;
+    std::streampos data_start;
+    long long total_points = 0;
+    long long remaining = 0;
+};
+
+PointStream point_stream;
+std::vector<long long> minibatch_counts;
+std::atomic<long long> batches_done(0);
+std::atomic<long long> points_streamed(0);
+int minibatch_epoch = 0;
+
+// Reads the centroid block that follows the points, skipping the points
+// without storing them.
+bool read_stream_centroids(const std::string& file_name, std::vector<Centroid>& out) {
+    std::ifstream file(file_name);
+    long long num_points;
+    if (!file || !(file >> num_points)) return false;
+
+    double skip;
+    for (long long i = 0; i < 2 * num_points; ++i) {
+        if (!(file >> skip)) return false;
+    }
+
+    int num_centroids;
+    if (!(file >> num_centroids) || num_centroids <= 0) return false;
+
+    out.clear();
+    for (int i = 0; i < num_centroids; ++i) {
+        Centroid c;
+        if (file >> c.x >> c.y) {
+            out.push_back(c);
+        }
+    }
+    return !out.empty();
+}
+
+// Nearest centroid for every point currently in `points`, without pruning.
+void assign_all_points() {
+    const size_t n = points.size();
+    nearest_cluster.resize(n);
+    sync_point_columns();
+    sync_centroid_columns();
+    prepare_centroid_index();
+    prepare_reduced_precision();
+
+    if (worker_pool) {
+        const size_t num_chunks = (n + PARALLEL_CHUNK_SIZE - 1) / PARALLEL_CHUNK_SIZE;
+        worker_pool->parallel_for(num_chunks, [&](size_t chunk) {
+            const size_t begin = chunk * PARALLEL_CHUNK_SIZE;
+            nearest_range(begin, std::min(n, begin + PARALLEL_CHUNK_SIZE), nearest_cluster.data());
+        });
+    } else {
+        nearest_range(0, n, nearest_cluster.data());
+    }
+}
+
+bool minibatch_begin(const std::string& file_name) {
+    close_mapped_points();
+    points.clear();
+    history.clear();
+
+    if (!read_stream_centroids(file_name, centroids) || !point_stream.open(file_name)) {
+        std::cerr << "Error opening file!" << std::endl;
+        return false;
+    }
+
+    minibatch_counts.assign(centroids.size(), 0);
+    batches_done = 0;
+    points_streamed = 0;
+    minibatch_epoch = 0;
+    return true;
+}
+
+// Loads the next batch and folds it into the centroids. Returns false once
+// every epoch has been streamed.
+bool minibatch_iteration() {
+    if (point_stream.read_batch(points, options.minibatch) == 0) {
+        if (++minibatch_epoch >= options.epochs) {
+            return false;
+        }
+        point_stream.rewind();
+        if (point_stream.read_batch(points, options.minibatch) == 0) {
+            return false;
+        }
+    }
+
+    const uint64_t distances_before = distances_computed;
+    auto phase_start = std::chrono::steady_clock::now();
+    assign_all_points();
+    profile[Phase::Assign].add(seconds_since(phase_start));
+
+    phase_start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < points.size(); ++i) {
+        int cluster = nearest_cluster[i];
+        points[i].cluster = cluster;
+        if (cluster < 0) continue;
+
+        double eta = 1.0 / ++minibatch_counts[cluster];
+        centroids[cluster].x += eta * (points[i].x - centroids[cluster].x);
+        centroids[cluster].y += eta * (points[i].y - centroids[cluster].y);
+    }
+
+    profile[Phase::Update].add(seconds_since(phase_start));
+
+    ProfileCounters counters;
+    counters.reassigned = points.size();    // every batch point is freshly assigned
+    counters.distances = distances_computed - distances_before;
+    finish_iteration_profile(counters);
+
+    batches_done++;
+    points_streamed += points.size();
+    mark_points_changed();
+    return true;
+}
+
+// Sum of squared distances from every point to its nearest centroid.
+double batch_inertia() {
+    assign_all_points();
+    return kmeans::inertia_range(point_view(), centroid_model(centroids), nearest_cluster.data(), 0, column_size);
+}
+
+// Streams the whole file once more to score the mini-batch centroids. With
+// --compare-full the file is also clustered with full-batch Lloyd iterations
+// from the same starting centroids, which loads every point.
+double report_minibatch_quality(std::ostream& out) {
+    const size_t batch_size = std::max<size_t>(options.minibatch, 1);
+    double stream_total = 0.0;
+    long long n = 0;
+
+    point_stream.rewind();
+    while (point_stream.read_batch(points, batch_size) > 0) {
+        stream_total += batch_inertia();
+        n += points.size();
+    }
+
+    out << "Mini-batch: " << batches_done << " batches, " << points_streamed
+              << " points streamed over " << minibatch_epoch << " epoch(s)\n";
+    out << "Mini-batch inertia: " << std::fixed << std::setprecision(4) << stream_total
+              << " (mean " << (n ? stream_total / n : 0.0) << " per point)" << std::endl;
+
+    if (!options.compare_full) return stream_total;
+
+    std::vector<Centroid> minibatch_centroids = centroids;
+    std::vector<Point> last_batch = points;
+    PhaseTimes saved_phase_times = phase_times;
+
+    read_from_file(options.input);
+    int iterations = 0;
+    while (kmeans_iteration()) {
+        iterations++;
+        history.clear();
+    }
+    history.clear();
+    double full_total = batch_inertia();
+
+    out << "Full-batch inertia: " << full_total << " after " << iterations + 1 << " iterations\n";
+    out << "Mini-batch / full-batch inertia ratio: " << std::setprecision(4)
+              << (full_total > 0 ? stream_total / full_total : 1.0) << std::endl;
+
+    centroids = minibatch_centroids;
+    points = last_batch;
+    phase_times = saved_phase_times;
+    sync_point_columns();
+    return stream_total;
+}
+
+void print_distance_counters(std::ostream& out) {
+    uint64_t computed = distances_computed;
+    uint64_t skipped = distances_skipped;
+    double total = (double)(computed + skipped);
+    out << "Distances computed: " << computed << ", skipped: " << skipped;
+    if (total > 0) {
+        out << " (" << std::fixed << std::setprecision(1) << 100.0 * skipped / total << "% pruned)";
+    }
+    out << std::endl;
+}
+
+// ---- Assignment benchmark ----
+// Times one full assignment pass per kernel against the reference
+// calculate_distance loop on uniformly scattered synthetic points. Any label
+// that differs from the reference is a mismatch.
+
+size_t count_mismatches(const std::vector<int>& reference, const std::vector<int>& result) {
+    size_t mismatches = 0;
+    for (size_t i = 0; i < reference.size(); ++i) {
+        mismatches += reference[i] != result[i];
+    }
+    return mismatches;
+}
+
+int run_assign_benchmark(size_t num_points, size_t num_centroids, int repeats) {
+    std::mt19937_64 rng(42);
+    std::uniform_real_distribution<double> coord(-100.0, 100.0);
+    close_mapped_points();
+
+    points.assign(num_points, Point{});
+    for (auto& p : points) {
+        p.x = coord(rng);
+        p.y = coord(rng);
+    }
+    centroids.assign(num_centroids, Centroid{});
+    for (auto& c : centroids) {
+        c.x = coord(rng);
+        c.y = coord(rng);
+    }
+    sync_point_columns();
+    sync_centroid_columns();
+
+    std::cout << "Assignment benchmark: " << num_points << " points, "
+              << num_centroids << " centroids, best of " << repeats << "\n";
+
+    std::vector<int> reference(num_points), result(num_points);
+    double reference_ms = 0.0;
+    int status = 0;
+
+    const AssignKernel kernels[] = { AssignKernel::Reference, AssignKernel::Scalar,
+                                     AssignKernel::SSE2, AssignKernel::AVX2 };
+    for (AssignKernel kernel : kernels) {
+        if (!assign_kernel_supported(kernel)) {
+            std::cout << std::setw(10) << assign_kernel_name(kernel) << ": not supported\n";
+            continue;
+        }
+
+        std::vector<int>& out = kernel == AssignKernel::Reference ? reference : result;
+        double best_ms = std::numeric_limits<double>::max();
+        for (int r = 0; r < repeats; ++r) {
+            auto start = std::chrono::steady_clock::now();
+            assign_range(kernel, 0, num_points, out.data());
+            auto stop = std::chrono::steady_clock::now();
+            best_ms = std::min(best_ms, std::chrono::duration<double, std::milli>(stop - start).count());
+        }
+
+        size_t mismatches = 0;
+        if (kernel == AssignKernel::Reference) {
+            reference_ms = best_ms;
+        } else {
+            mismatches = count_mismatches(reference, result);
+        }
+        if (mismatches) status = 1;
+
+        std::cout << std::setw(10) << assign_kernel_name(kernel) << ": "
+                  << std::fixed << std::setprecision(3) << best_ms << " ms  "
+                  << std::setprecision(2) << reference_ms / best_ms << "x  "
+                  << "mismatches: " << mismatches << "\n";
+    }
+    {
+        // float32 scan with exact fallback; the float copies are built once up front.
+        const AssignPrecision saved = assign_precision;
+        assign_precision = AssignPrecision::Mixed;
+        prepare_reduced_precision();
+        double best_ms = std::numeric_limits<double>::max();
+        uint64_t fallbacks_before = exact_fallbacks;
+        for (int r = 0; r < repeats; ++r) {
+            auto start = std::chrono::steady_clock::now();
+            reduced_assign_range(0, num_points, result.data());
+            auto stop = std::chrono::steady_clock::now();
+            best_ms = std::min(best_ms, std::chrono::duration<double, std::milli>(stop - start).count());
+        }
+        assign_precision = saved;
+        reduced.usable = false;
+        const double fallback_share = 100.0 * (exact_fallbacks - fallbacks_before) / repeats / num_points;
+
+        const size_t mismatches = count_mismatches(reference, result);
+        if (mismatches) status = 1;
+
+        std::cout << std::setw(10) << assign_precision_name(AssignPrecision::Mixed) << ": "
+                  << std::fixed << std::setprecision(3) << best_ms << " ms  "
+                  << std::setprecision(2) << reference_ms / best_ms << "x  "
+                  << "mismatches: " << mismatches << "  "
+                  << std::setprecision(3) << fallback_share << "% exact fallbacks\n";
+    }
+    {
+        // Cold queries (no hint); includes the tree build.
+        for (auto& p : points) p.cluster = -1;
+        uint64_t computed_before = distances_computed;
+        double best_ms = std::numeric_limits<double>::max();
+        for (int r = 0; r < repeats; ++r) {
+            auto start = std::chrono::steady_clock::now();
+            centroid_tree.build(centroids);
+            tree_assign_range(0, num_points, result.data());
+            auto stop = std::chrono::steady_clock::now();
+            best_ms = std::min(best_ms, std::chrono::duration<double, std::milli>(stop - start).count());
+        }
+        const double per_point = (double)(distances_computed - computed_before) / repeats / num_points;
+
+        const size_t mismatches = count_mismatches(reference, result);
+        if (mismatches) status = 1;
+
+        std::cout << std::setw(10) << centroid_index_name(CentroidIndex::KdTree) << ": "
+                  << std::fixed << std::setprecision(3) << best_ms << " ms  "
+                  << std::setprecision(2) << reference_ms / best_ms << "x  "
+                  << "mismatches: " << mismatches << "  "
+                  << std::setprecision(1) << per_point << " distances/point\n";
+    }
+    if (worker_pool) {
+        const size_t num_chunks = (num_points + PARALLEL_CHUNK_SIZE - 1) / PARALLEL_CHUNK_SIZE;
+        double best_ms = std::numeric_limits<double>::max();
+        for (int r = 0; r < repeats; ++r) {
+            auto start = std::chrono::steady_clock::now();
+            worker_pool->parallel_for(num_chunks, [&](size_t chunk) {
+                const size_t begin = chunk * PARALLEL_CHUNK_SIZE;
+                assign_range(assign_kernel, begin, std::min(num_points, begin + PARALLEL_CHUNK_SIZE), result.data());
+            });
+            auto stop = std::chrono::steady_clock::now();
+            best_ms = std::min(best_ms, std::chrono::duration<double, std::milli>(stop - start).count());
+        }
+
+        const size_t mismatches = count_mismatches(reference, result);
+        if (mismatches) status = 1;
+
+        std::cout << std::setw(10) << assign_kernel_name(assign_kernel) << " x" << worker_pool->size() << ": "
+                  << std::fixed << std::setprecision(3) << best_ms << " ms  "
+                  << std::setprecision(2) << reference_ms / best_ms << "x  "
+                  << "mismatches: " << mismatches << "\n";
+    }
+    return status;
+}
+
+// ---- Synthetic data ----
+// Gaussian blobs: K centres spread uniformly over the plot range, points drawn
+// around a randomly chosen centre. The starting centroids are K distinct points
+// of the generated set, the same way a data file would supply them.
+
+void generate_blobs(size_t num_points, size_t num_centroids, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    std::uniform_real_distribution<double> center_coord(-80.0, 80.0);
+    std::normal_distribution<double> spread(0.0, 6.0);
+    std::uniform_int_distribution<size_t> pick_blob(0, num_centroids - 1);
+
+    close_mapped_points();
+    std::vector<Centroid> centers(num_centroids);
+    for (auto& c : centers) {
+        c.x = center_coord(rng);
+        c.y = center_coord(rng);
+    }
+
+    points.assign(num_points, Point{});
+    for (auto& p : points) {
+        const Centroid& c = centers[pick_blob(rng)];
+        p.x = c.x + spread(rng);
+        p.y = c.y + spread(rng);
+    }
+
+    centroids.clear();
+    std::vector<char> taken(num_points, 0);
+    std::uniform_int_distribution<size_t> pick_point(0, num_points - 1);
+    while (centroids.size() < std::min(num_centroids, num_points)) {
+        size_t i = pick_point(rng);
+        if (taken[i]) continue;
+        taken[i] = 1;
+        centroids.push_back(Centroid{points[i].x, points[i].y});
+    }
+
+    history.clear();
+    sync_point_columns();
+}
+
+bool write_to_file(const std::string& file_name) {
+    std::ofstream file(file_name);
+    if (!file) {
+        std::cerr << "Error writing " << file_name << std::endl;
+        return false;
+    }
+    file << std::setprecision(17) << points.size() << "\n";
+    for (const auto& p : points) {
+        file << p.x << " " << p.y << "\n";
+    }
+    file << centroids.size() << "\n";
+    for (const auto& c : centroids) {
+        file << c.x << " " << c.y << "\n";
+    }
+    return bool(file);
+}
+
+// Fills points/centroids from --generate, --minibatch or --input.
+bool load_input() {
+    if (options.minibatch) {
+        return minibatch_begin(options.input);
+    }
+    if (options.generate_points > 0) {
+        generate_blobs(options.generate_points, options.generate_centroids, options.seed);
+        if (!options.write_data.empty() && !write_to_file(options.write_data)) {
+            return false;
+        }
+    } else {
+        read_from_file(options.input);
+    }
+    if (points.empty()) {
+        return false;
+    }
+    if (centroids.empty() && (init_mode == InitMode::File || options.k == 0)) {
+        std::cerr << "No centroids in the input; use --init with --k to seed them" << std::endl;
+        return false;
+    }
+    seed_centroids(init_mode, options.k, options.seed);
+    return true;
+}
+
+// ---- Sharded workers ----
+// Coordinator/worker mode: the points are split into contiguous shards, one
+// per forked worker process. Each iteration the coordinator sends the
+// centroids to every worker, each worker assigns its shard and returns its
+// partial sums, counts and number of reassigned points, and the coordinator
+// merges the partials in worker order and computes the new centroids. The
+// worker only needs its shard of the coordinate columns; with a binary point
+// file those are pages of the shared file mapping.
+//
+// The transport is pluggable. "socket" sends the messages over a Unix domain
+// socket pair; "shm" exchanges them through a POSIX shared memory region per
+// worker, handing it back and forth with a pair of process-shared
+// semaphores. A remote transport only has to implement the same four calls.
+//
+// A worker keeps no handle to any other worker's transport, so when one dies
+// the coordinator sees EOF on its socket, or, for shm, notices the exit while
+// polling its semaphore, and the run fails instead of hanging.
+
+enum class TransportKind { Socket, SharedMemory };
+
+TransportKind shard_transport = TransportKind::Socket;
+
+const char* transport_name(TransportKind kind) {
+    return kind == TransportKind::Socket ? "socket" : "shm";
+}
+
+enum : uint32_t { SHARD_ITERATE = 1, SHARD_QUIT = 2 };
+
+struct ShardPartial {
+    uint64_t reassigned = 0;
+    std::vector<double> sum_x, sum_y;
+    std::vector<int64_t> count;
+
+    void reset(size_t k) {
+        reassigned = 0;
+        sum_x.assign(k, 0.0);
+        sum_y.assign(k, 0.0);
+        count.assign(k, 0);
+    }
+};
+
+class ShardTransport {
+public:
+    virtual ~ShardTransport() {}
+
+    // Called in both processes right after fork(); pid is fork()'s result,
+    // so 0 in the worker.
+    virtual void after_fork(pid_t pid) = 0;
+
+    // Called in a worker for every other worker's transport. Drops this
+    // process's handles without touching state the owners still share.
+    virtual void detach() = 0;
+
+    // Coordinator side. centroid_xy holds x0, y0, x1, y1, ...
+    virtual bool send_request(uint32_t op, const std::vector<double>& centroid_xy) = 0;
+    virtual bool receive_reply(ShardPartial& partial) = 0;
+
+    // Worker side.
+    virtual bool receive_request(uint32_t& op, std::vector<double>& centroid_xy) = 0;
+    virtual bool send_reply(const ShardPartial& partial) = 0;
+};
+
+static bool write_all(int fd, const void* data, size_t length) {
+    const char* p = (const char*)data;
+    while (length > 0) {
+        ssize_t n = write(fd, p, length);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        length -= n;
+    }
+    return true;
+}
+
+// write_all for sockets: a peer that has gone away is an error, not SIGPIPE.
+static bool send_all(int fd, const void* data, size_t length) {
+    const char* p = (const char*)data;
+    while (length > 0) {
+        ssize_t n = send(fd, p, length, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        length -= n;
+    }
+    return true;
+}
+
+static bool read_all(int fd, void* data, size_t length) {
+    char* p = (char*)data;
+    while (length > 0) {
+        ssize_t n = read(fd, p, length);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        length -= n;
+    }
+    return true;
+}
+
+class SocketTransport : public ShardTransport {
+public:
+    SocketTransport() {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) fds[0] = fds[1] = -1;
+    }
+    ~SocketTransport() override {
+        for (int fd : fds) if (fd >= 0) close(fd);
+    }
+
+    bool ok() const { return fds[0] >= 0; }
+
+    void after_fork(pid_t pid) override {
+        const bool in_worker = pid == 0;
+        int& other = fds[in_worker ? 0 : 1];
+        close(other);
+        other = -1;
+        fd = fds[in_worker ? 1 : 0];
+    }
+
+    void detach() override {
+        for (int& end : fds) {
+            if (end >= 0) close(end);
+            end = -1;
+        }
+        fd = -1;
+    }
+
+    bool send_request(uint32_t op, const std::vector<double>& centroid_xy) override {
+        const uint32_t head[2] = { op, (uint32_t)(centroid_xy.size() / 2) };
+        return send_all(fd, head, sizeof(head)) &&
+               send_all(fd, centroid_xy.data(), centroid_xy.size() * sizeof(double));
+    }
+
+    bool receive_reply(ShardPartial& partial) override {
+        const size_t k = partial.count.size();
+        return read_all(fd, &partial.reassigned, sizeof(partial.reassigned)) &&
+               read_all(fd, partial.sum_x.data(), k * sizeof(double)) &&
+               read_all(fd, partial.sum_y.data(), k * sizeof(double)) &&
+               read_all(fd, partial.count.data(), k * sizeof(int64_t));
+    }
+
+    bool receive_request(uint32_t& op, std::vector<double>& centroid_xy) override {
+        uint32_t head[2];
+        if (!read_all(fd, head, sizeof(head))) return false;
+        op = head[0];
+        centroid_xy.resize((size_t)head[1] * 2);
+        return read_all(fd, centroid_xy.data(), centroid_xy.size() * sizeof(double));
+    }
+
+    bool send_reply(const ShardPartial& partial) override {
+        const size_t k = partial.count.size();
+        return send_all(fd, &partial.reassigned, sizeof(partial.reassigned)) &&
+               send_all(fd, partial.sum_x.data(), k * sizeof(double)) &&
+               send_all(fd, partial.sum_y.data(), k * sizeof(double)) &&
+               send_all(fd, partial.count.data(), k * sizeof(int64_t));
+    }
+
+private:
+    int fds[2] = { -1, -1 };
+    int fd = -1;
+};
+
+// Layout of the shared region: this header, then 2k doubles of centroids,
+// then the reply (k sum_x, k sum_y, k counts).
+struct ShardMailbox {
+    sem_t request_ready;
+    sem_t reply_ready;
+    uint32_t op;
+    uint32_t k;
+    uint64_t reassigned;
+};
+
+class SharedMemoryTransport : public ShardTransport {
+public:
+    SharedMemoryTransport(size_t max_k, int index) : capacity(max_k) {
+        const std::string name = "/a3-shard-" + std::to_string(getpid()) + "-" + std::to_string(index);
+        length = sizeof(ShardMailbox) + capacity * (4 * sizeof(double) + sizeof(int64_t));
+        int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0) return;
+        // Unlinked right away: the mapping stays valid and is inherited by fork().
+        shm_unlink(name.c_str());
+        if (ftruncate(fd, length) == 0) {
+            void* base = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (base != MAP_FAILED) {
+                box = (ShardMailbox*)base;
+                sem_init(&box->request_ready, 1, 0);
+                sem_init(&box->reply_ready, 1, 0);
+            }
+        }
+        close(fd);
+    }
+    // Only the coordinator runs this, after every worker has been reaped.
+    ~SharedMemoryTransport() override {
+        if (!box) return;
+        sem_destroy(&box->request_ready);
+        sem_destroy(&box->reply_ready);
+        munmap(box, length);
+    }
+
+    bool ok() const { return box != nullptr; }
+
+    void after_fork(pid_t pid) override {
+        peer = pid == 0 ? getppid() : pid;
+        in_worker = pid == 0;
+    }
+
+    void detach() override {
+        if (box) munmap(box, length);
+        box = nullptr;
+    }
+
+    bool send_request(uint32_t op, const std::vector<double>& centroid_xy) override {
+        const size_t k = centroid_xy.size() / 2;
+        if (k > capacity) return false;
+        box->op = op;
+        box->k = k;
+        memcpy(centroid_area(), centroid_xy.data(), centroid_xy.size() * sizeof(double));
+        return sem_post(&box->request_ready) == 0;
+    }
+
+    bool receive_reply(ShardPartial& partial) override {
+        if (!wait(&box->reply_ready)) return false;
+        const size_t k = partial.count.size();
+        partial.reassigned = box->reassigned;
+        memcpy(partial.sum_x.data(), reply_area(), k * sizeof(double));
+        memcpy(partial.sum_y.data(), reply_area() + capacity, k * sizeof(double));
+        memcpy(partial.count.data(), reply_area() + 2 * capacity, k * sizeof(int64_t));
+        return true;
+    }
+
+    bool receive_request(uint32_t& op, std::vector<double>& centroid_xy) override {
+        if (!wait(&box->request_ready)) return false;
+        op = box->op;
+        centroid_xy.assign(centroid_area(), centroid_area() + 2 * (size_t)box->k);
+        return true;
+    }
+
+    bool send_reply(const ShardPartial& partial) override {
+        const size_t k = partial.count.size();
+        box->reassigned = partial.reassigned;
+        memcpy(reply_area(), partial.sum_x.data(), k * sizeof(double));
+        memcpy(reply_area() + capacity, partial.sum_y.data(), k * sizeof(double));
+        memcpy(reply_area() + 2 * capacity, partial.count.data(), k * sizeof(int64_t));
+        return sem_post(&box->reply_ready) == 0;
+    }
+
+private:
+    // Waits for sem, checking every SHARD_POLL_NS that the other side is alive.
+    bool wait(sem_t* sem) const {
+        const long SHARD_POLL_NS = 100000000;
+        for (;;) {
+            timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += SHARD_POLL_NS;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            if (sem_timedwait(sem, &deadline) == 0) return true;
+            if (errno == EINTR) continue;
+            if (errno != ETIMEDOUT || !peer_alive()) return false;
+        }
+    }
+
+    // The worker checks it has not been reparented; the coordinator checks
+    // the worker has not exited, without reaping it (WNOWAIT).
+    bool peer_alive() const {
+        if (in_worker) return getppid() == peer;
+        siginfo_t info;
+        info.si_pid = 0;
+        return waitid(P_PID, peer, &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid == 0;
+    }
+
+    double* centroid_area() const { return (double*)(box + 1); }
+    double* reply_area() const { return centroid_area() + 2 * capacity; }
+
+    ShardMailbox* box = nullptr;
+    size_t capacity = 0;
+    size_t length = 0;
+    pid_t peer = 0;
+    bool in_worker = false;
+};
+
+// Worker process body: serves requests for points [begin, end) until QUIT.
+static void shard_worker(ShardTransport& transport, size_t begin, size_t end) {
+    const size_t n = end - begin;
+    const double* xs = column_x + begin;
+    const double* ys = column_y + begin;
+    std::vector<int> labels(n, -1), nearest(n);
+    std::vector<double> centroid_xy, cx, cy;
+    ShardPartial partial;
+    uint32_t op;
+
+    while (transport.receive_request(op, centroid_xy) && op == SHARD_ITERATE) {
+        const size_t k = centroid_xy.size() / 2;
+        cx.resize(k);
+        cy.resize(k);
+        for (size_t c = 0; c < k; ++c) {
+            cx[c] = centroid_xy[2 * c];
+            cy[c] = centroid_xy[2 * c + 1];
+        }
+        assign_columns(assign_kernel, xs, ys, n, cx.data(), cy.data(), k, nearest.data());
+
+        partial.reset(k);
+        for (size_t i = 0; i < n; ++i) {
+            const int cluster = nearest[i];
+            partial.reassigned += labels[i] != cluster;
+            labels[i] = cluster;
+            if (cluster < 0) continue;
+            partial.sum_x[cluster] += xs[i];
+            partial.sum_y[cluster] += ys[i];
+            partial.count[cluster]++;
+        }
+        if (!transport.send_reply(partial)) break;
+    }
+}
+
+struct ShardRunResult {
+    int iterations = 0;
+    bool converged = false;
+    double seconds = 0.0;
+    double inertia = 0.0;
+};
+
+// Clusters the loaded points with num_workers worker processes, starting from
+// the current centroids. Returns false if the workers could not be started.
+bool run_sharded(size_t num_workers, TransportKind kind, ShardRunResult& result) {
+    const size_t n = points.size();
+    const size_t k = centroids.size();
+    if (column_size != n) sync_point_columns();
+
+    std::vector<std::unique_ptr<ShardTransport>> transports;
+    for (size_t w = 0; w < num_workers; ++w) {
+        if (kind == TransportKind::Socket) {
+            auto transport = std::unique_ptr<SocketTransport>(new SocketTransport());
+            if (!transport->ok()) return false;
+            transports.push_back(std::move(transport));
+        } else {
+            auto transport = std::unique_ptr<SharedMemoryTransport>(new SharedMemoryTransport(k, w));
+            if (!transport->ok()) return false;
+            transports.push_back(std::move(transport));
+        }
+    }
+
+    std::cout.flush();
+    std::cerr.flush();
+    std::vector<pid_t> workers;
+    for (size_t w = 0; w < num_workers; ++w) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            break;
+        }
+        if (pid == 0) {
+            // The child never returns into the rest of the program: no
+            // worker pool, logger or GTK state is valid after fork().
+            for (size_t v = 0; v < num_workers; ++v) {
+                if (v != w) transports[v]->detach();
+            }
+            transports[w]->after_fork(0);
+            shard_worker(*transports[w], n * w / num_workers, n * (w + 1) / num_workers);
+            _exit(0);
+        }
+        transports[w]->after_fork(pid);
+        workers.push_back(pid);
+    }
+
+    bool ok = workers.size() == num_workers;
+    std::vector<double> centroid_xy(2 * k);
+    ShardPartial partial, total;
+    partial.reset(k);
+
+    auto start = std::chrono::steady_clock::now();
+    result = ShardRunResult();
+    while (ok && result.iterations < options.max_iterations) {
+        for (size_t c = 0; c < k; ++c) {
+            centroid_xy[2 * c] = centroids[c].x;
+            centroid_xy[2 * c + 1] = centroids[c].y;
+        }
+        for (auto& transport : transports) {
+            ok = ok && transport->send_request(SHARD_ITERATE, centroid_xy);
+        }
+
+        total.reset(k);
+        for (auto& transport : transports) {
+            if (!ok || !transport->receive_reply(partial)) {
+                ok = false;
+                break;
+            }
+            total.reassigned += partial.reassigned;
+            for (size_t c = 0; c < k; ++c) {
+                total.sum_x[c] += partial.sum_x[c];
+                total.sum_y[c] += partial.sum_y[c];
+                total.count[c] += partial.count[c];
+            }
+        }
+        if (!ok) break;
+
+        for (size_t c = 0; c < k; ++c) {
+            if (total.count[c] > 0) {
+                centroids[c].x = total.sum_x[c] / total.count[c];
+                centroids[c].y = total.sum_y[c] / total.count[c];
+            }
+        }
+        result.iterations++;
+        if (total.reassigned == 0) {
+            result.converged = true;
+            break;
+        }
+    }
+    result.seconds = seconds_since(start);
+
+    for (size_t w = 0; w < workers.size(); ++w) {
+        transports[w]->send_request(SHARD_QUIT, std::vector<double>());
+    }
+    for (pid_t pid : workers) {
+        waitpid(pid, nullptr, 0);
+    }
+    if (!ok) {
+        std::cerr << "Sharded run failed: lost contact with a worker" << std::endl;
+        return false;
+    }
+
+    result.inertia = batch_inertia();
+    return true;
+}
+
+// --shards=N runs once with N workers; --shard-scaling=MAX runs 1, 2, 4, ...
+// MAX workers from the same starting centroids and prints one JSON line per
+// run with speedup and efficiency relative to the single-worker run.
+int run_sharded_headless() {
+    if (!load_input()) {
+        return 1;
+    }
+    const std::vector<Centroid> start = centroids;
+
+    std::vector<size_t> counts;
+    if (options.shard_scaling > 0) {
+        for (size_t w = 1; w < options.shard_scaling; w *= 2) counts.push_back(w);
+        counts.push_back(options.shard_scaling);
+    } else {
+        counts.push_back(options.shards);
+    }
+
+    double baseline = 0.0;
+    for (size_t workers : counts) {
+        centroids = start;
+        ShardRunResult result;
+        if (!run_sharded(workers, shard_transport, result)) {
+            return 1;
+        }
+        if (workers == 1) baseline = result.seconds;
+        const double speedup = baseline > 0 && result.seconds > 0 ? baseline / result.seconds : 0.0;
+
+        std::cout << std::setprecision(6) << std::defaultfloat
+                  << "{\"mode\":\"sharded\""
+                  << ",\"transport\":\"" << transport_name(shard_transport) << "\""
+                  << ",\"workers\":" << workers
+                  << ",\"points\":" << points.size()
+                  << ",\"centroids\":" << centroids.size()
+                  << ",\"iterations\":" << result.iterations
+                  << ",\"converged\":" << (result.converged ? "true" : "false")
+                  << ",\"wall_seconds\":" << result.seconds
+                  << ",\"seconds_per_iteration\":" << (result.iterations ? result.seconds / result.iterations : 0.0);
+        if (baseline > 0) {
+            std::cout << ",\"speedup\":" << speedup
+                      << ",\"efficiency\":" << speedup / workers;
+        }
+        std::cout << ",\"inertia\":" << std::setprecision(17) << result.inertia
+                  << "}" << std::endl;
+    }
+    return 0;
+}
+
+// ---- Checkpoints ----
+// --checkpoint=PATH saves the clustering state every --checkpoint-every
+// iterations, on SIGUSR1, and on SIGTERM/SIGINT (after which the run stops).
+// Headless runs catch the signals with sigaction and act on them after the
+// current iteration. The GUI takes them on the main loop and wakes the k-means
+// thread, which saves even while paused or after convergence and then quits
+// the application; without --checkpoint the GUI leaves the signals alone.
+// The k-means thread only packs the state into a buffer between iterations;
+// a background thread writes it to PATH.tmp and renames it over PATH, so a
+// crash never leaves a torn checkpoint behind. If the previous write is still
+// running when the next one is due, the new one is skipped rather than
+// waited for. --resume=PATH maps a checkpoint and continues from its
+// iteration with the same input.
+//
+// Layout: CheckpointHeader, then the centroids (x, y pairs), the labels packed
+// as label + 1 in label_width bytes, the serialized HistoryStore, and the
+// text state of reseed_rng (rng_bytes, 0 in checkpoints that predate it).
+
+struct CheckpointHeader {
+    char magic[4];          // "KMCK"
+    uint32_t version;       // 1
+    uint64_t num_points;
+    uint64_t num_centroids;
+    uint64_t fingerprint;   // of the point coordinates, see points_fingerprint
+    int64_t iterations;     // completed iterations
+    uint32_t label_width;
+    uint32_t reserved0;
+    uint64_t history_bytes;
+    uint64_t rng_bytes;
+};
+
+static_assert(sizeof(CheckpointHeader) == 64, "checkpoint header must stay 64 bytes");
+
+std::atomic<int> checkpoint_signal(0);   // 1 = SIGUSR1, 2 = stop after saving
+
+static_assert(std::atomic<int>::is_always_lock_free, "checkpoint_signal is set from a signal handler");
+
+static void on_checkpoint_signal(int sig) {
+    if (sig != SIGUSR1) {
+        checkpoint_signal = 2;
+    } else {
+        int idle = 0;
+        checkpoint_signal.compare_exchange_strong(idle, 1);
+    }
+}
+
+// Cheap identity check that a checkpoint belongs to the loaded points.
+static uint64_t points_fingerprint() {
+    uint64_t hash = 1469598103934665603ULL ^ column_size;
+    const size_t samples = std::min<size_t>(column_size, 64);
+    for (size_t j = 0; j < samples; ++j) {
+        const size_t i = j * column_size / samples;
+        const double xy[2] = { column_x[i], column_y[i] };
+        const uint8_t* bytes = (const uint8_t*)xy;
+        for (size_t b = 0; b < sizeof(xy); ++b) {
+            hash = (hash ^ bytes[b]) * 1099511628211ULL;
+        }
+    }
+    return hash;
+}
+
+class CheckpointWriter {
+public:
+    ~CheckpointWriter() { wait(); }
+
+    std::string path;
+    int every = 0;
+
+    // Packs the current state and hands it to the writer thread. Returns false
+    // if the previous checkpoint is still being written.
+    bool save(int64_t iterations) {
+        if (busy) return false;
+        wait();
+
+        buffer.clear();
+        const size_t n = points.size();
+        const size_t k = centroids.size();
+        const uint32_t label_width = k <= 0xff ? 1 : k <= 0xffff ? 2 : 4;
+
+        CheckpointHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, "KMCK", 4);
+        header.version = 1;
+        header.num_points = n;
+        header.num_centroids = k;
+        header.fingerprint = points_fingerprint();
+        header.iterations = iterations;
+        header.label_width = label_width;
+        append_bytes(buffer, &header, sizeof(header));
+
+        for (const Centroid& c : centroids) {
+            const double xy[2] = { c.x, c.y };
+            append_bytes(buffer, xy, sizeof(xy));
+        }
+        const size_t labels_at = buffer.size();
+        buffer.resize(labels_at + n * label_width);
+        for (size_t i = 0; i < n; ++i) {
+            const uint32_t value = (uint32_t)(points[i].cluster + 1);
+            memcpy(buffer.data() + labels_at + i * label_width, &value, label_width);
+        }
+        const size_t history_at = buffer.size();
+        history.serialize(buffer);
+        const uint64_t history_bytes = buffer.size() - history_at;
+        memcpy(buffer.data() + offsetof(CheckpointHeader, history_bytes), &history_bytes, sizeof(history_bytes));
+
+        std::ostringstream rng_state;
+        rng_state << reseed_rng;
+        const std::string rng_text = rng_state.str();
+        append_bytes(buffer, rng_text.data(), rng_text.size());
+        const uint64_t rng_bytes = rng_text.size();
+        memcpy(buffer.data() + offsetof(CheckpointHeader, rng_bytes), &rng_bytes, sizeof(rng_bytes));
+
+        busy = true;
+        writer = std::thread([this] {
+            write_file();
+            busy = false;
+        });
+        return true;
+    }
+
+    // Blocks until the pending write (if any) has finished.
+    void wait() {
+        if (writer.joinable()) writer.join();
+    }
+
+private:
+    void write_file() {
+        const std::string tmp = path + ".tmp";
+        int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        bool ok = fd >= 0 && write_all(fd, buffer.data(), buffer.size()) && fsync(fd) == 0;
+        if (fd >= 0) close(fd);
+        if (ok && rename(tmp.c_str(), path.c_str()) == 0) {
+            written++;
+        } else {
+            std::cerr << "Checkpoint write to '" << path << "' failed" << std::endl;
+            unlink(tmp.c_str());
+        }
+    }
+
+    std::vector<uint8_t> buffer;
+    std::thread writer;
+    std::atomic<bool> busy{false};
+    uint64_t written = 0;
+};
+
+CheckpointWriter checkpoint_writer;
+
+// Called by the run loops after every iteration. Returns false when a stop
+// signal arrived; the final checkpoint has been written by then.
+bool checkpoint_after_iteration(int64_t iterations) {
+    if (checkpoint_writer.path.empty()) return true;
+
+    const int signal = checkpoint_signal;
+    if (signal == 2) {
+        checkpoint_writer.wait();
+        checkpoint_writer.save(iterations);
+        checkpoint_writer.wait();
+        std::cerr << "Checkpoint saved at iteration " << iterations << ", stopping" << std::endl;
+        return false;
+    }
+    const bool periodic = checkpoint_writer.every > 0 && iterations % checkpoint_writer.every == 0;
+    if ((signal == 1 || periodic) && checkpoint_writer.save(iterations) && signal == 1) {
+        int requested = 1;
+        checkpoint_signal.compare_exchange_strong(requested, 0);
+    }
+    return true;
+}
+
+// Serves a signal that arrived while no iteration is due (paused, waiting or
+// finished). Nothing else is pending, so a busy writer is waited for instead
+// of deferring the save. Returns false when the run should stop.
+bool checkpoint_while_idle(int64_t iterations) {
+    checkpoint_writer.wait();
+    if (checkpoint_signal == 2) return checkpoint_after_iteration(iterations);
+    checkpoint_writer.save(iterations);
+    int requested = 1;
+    checkpoint_signal.compare_exchange_strong(requested, 0);
+    return true;
+}
+
+// Restores labels, centroids and history from a checkpoint for the loaded
+// points. Everything is decoded and checked before any of it is applied, so a
+// damaged checkpoint leaves the loaded state untouched. Returns the number of
+// completed iterations, or -1 on error.
+int64_t resume_from_checkpoint(const std::string& file_name) {
+    int fd = open(file_name.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CheckpointHeader)) {
+        std::cerr << "Cannot read checkpoint '" << file_name << "'" << std::endl;
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    const size_t length = st.st_size;
+    void* base = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        std::cerr << "Cannot map checkpoint '" << file_name << "'" << std::endl;
+        return -1;
+    }
+
+    if (column_size != points.size()) sync_point_columns();
+    CheckpointHeader header;
+    memcpy(&header, base, sizeof(header));
+    const uint8_t* data = (const uint8_t*)base + sizeof(header);
+    const size_t n = header.num_points, k = header.num_centroids, width = header.label_width;
+    const size_t expected = sizeof(header) + k * 2 * sizeof(double) + n * width + header.history_bytes +
+                            header.rng_bytes;
+
+    int64_t iterations = -1;
+    if (memcmp(header.magic, "KMCK", 4) != 0 || header.version != 1 || expected != length ||
+        (width != 1 && width != 2 && width != 4)) {
+        std::cerr << "'" << file_name << "' is not a valid checkpoint" << std::endl;
+    } else if (n != points.size() || header.fingerprint != points_fingerprint()) {
+        std::cerr << "Checkpoint '" << file_name << "' was taken on different points" << std::endl;
+    } else {
+        std::vector<Centroid> restored_centroids(k);
+        for (size_t c = 0; c < k; ++c) {
+            double xy[2];
+            memcpy(xy, data + c * sizeof(xy), sizeof(xy));
+            restored_centroids[c].x = xy[0];
+            restored_centroids[c].y = xy[1];
+        }
+        // Stored as label + 1, so anything above k points past the centroids.
+        const uint8_t* labels = data + k * 2 * sizeof(double);
+        std::vector<int> restored_labels(n);
+        bool labels_valid = true;
+        for (size_t i = 0; i < n && labels_valid; ++i) {
+            uint32_t value = 0;
+            memcpy(&value, labels + i * width, width);
+            labels_valid = value <= k;
+            restored_labels[i] = (int)value - 1;
+        }
+        const uint8_t* rng_text = labels + n * width + header.history_bytes;
+        std::istringstream rng_state(std::string((const char*)rng_text, header.rng_bytes));
+        std::mt19937_64 rng = reseed_rng;
+        HistoryStore restored_history;
+        restored_history.snapshot_interval = history.snapshot_interval;
+        if (!labels_valid) {
+            std::cerr << "Checkpoint '" << file_name << "' has a label outside the centroids" << std::endl;
+        } else if (header.rng_bytes && !(rng_state >> rng)) {
+            std::cerr << "Checkpoint '" << file_name << "' has a damaged RNG state" << std::endl;
+        } else if (!restored_history.deserialize(labels + n * width, header.history_bytes) ||
+                   !restored_history.matches(n, k)) {
+            std::cerr << "Checkpoint '" << file_name << "' has a damaged history" << std::endl;
+        } else {
+            centroids = std::move(restored_centroids);
+            for (size_t i = 0; i < n; ++i) {
+                points[i].cluster = restored_labels[i];
+            }
+            history = std::move(restored_history);
+            reseed_rng = rng;
+            iterations = header.iterations;
+        }
+    }
+    munmap(base, length);
+
+    if (iterations >= 0) {
+        hamerly_reset();
+        mark_points_changed();
+    }
+    return iterations;
+}
+
+int64_t resumed_iterations = 0;    // completed iterations restored by --resume
+
+// Applies --resume after load_input(). The loaded centroids are replaced.
+bool resume_if_requested() {
+    if (options.resume.empty()) return true;
+    resumed_iterations = resume_from_checkpoint(options.resume);
+    if (resumed_iterations < 0) {
+        resumed_iterations = 0;
+        return false;
+    }
+    std::cerr << "Resumed from '" << options.resume << "' after iteration " << resumed_iterations << std::endl;
+    return true;
+}
+
+// GUI runs: the signal arrives on the main loop and wakes the k-means thread,
+// which serves it from wait_for_next_iteration or after the run finished.
+static gboolean on_gui_checkpoint_signal(gpointer data) {
+    on_checkpoint_signal(GPOINTER_TO_INT(data));
+    wake_kmeans_thread();
+    return G_SOURCE_CONTINUE;
+}
+
+void start_checkpoints() {
+    checkpoint_writer.path = options.checkpoint;
+    checkpoint_writer.every = options.checkpoint_every;
+    if (checkpoint_writer.path.empty()) return;
+
+    if (!options.headless) {
+        const int signals[] = { SIGUSR1, SIGTERM, SIGINT };
+        for (int sig : signals) {
+            g_unix_signal_add(sig, on_gui_checkpoint_signal, GINT_TO_POINTER(sig));
+        }
+        return;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_checkpoint_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+    sigaction(SIGINT, &action, nullptr);
+}
+
+// ---- Headless mode ----
+// Runs to convergence at full speed without initialising GTK and prints a
+// single JSON object on stdout. Human-readable notes go to stderr.
+
+static std::string json_escape(const std::string& text) {
+    std::string out;
+    for (char ch : text) {
+        if (ch == '"' || ch == '\\') out += '\\';
+        if ((unsigned char)ch < 0x20) continue;
+        out += ch;
+    }
+    return out;
+}
+
+static long peak_rss_kb() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return -1;
+    return usage.ru_maxrss;
+}
+
+// ---- K sweep ----
+// --sweep=KMIN-KMAX[:STEP] clusters the loaded points once per (K, restart)
+// pair and summarises the results for choosing K. The point columns are
+// loaded once (mapped read-only for binary files) and shared by every job;
+// each job keeps its own centroids, labels and sums, seeds with the shared
+// k-means++ from its own RNG and seeding state, and runs Lloyd iterations to
+// convergence on one thread. Jobs are ordered largest K first and handed out
+// through the pool's single shared job counter (no per-thread queues or
+// stealing): each idle thread takes the next index, so the expensive jobs
+// start early and the cheap ones fill in the gaps at the end.
+//
+// The silhouette is computed on a fixed, evenly spaced sample of points
+// (--silhouette-sample, exact pairwise distances within the sample), which
+// keeps it O(S^2) per job instead of O(n^2). The elbow is the K whose best
+// inertia lies farthest below the straight line from the first to the last K.
+
+struct SweepJob {
+    size_t k = 0;
+    uint64_t seed = 0;
+    int iterations = 0;
+    bool converged = false;
+    double inertia = 0.0;
+    double silhouette = 0.0;
+    double seconds = 0.0;
+};
+
+static double sample_silhouette(const std::vector<size_t>& sample, const std::vector<int>& labels, size_t k) {
+    const size_t s = sample.size();
+    std::vector<double> cluster_total(k);
+    std::vector<size_t> cluster_size(k, 0);
+    for (size_t a : sample) {
+        if (labels[a] >= 0) cluster_size[labels[a]]++;
+    }
+
+    double sum = 0.0;
+    size_t counted = 0;
+    for (size_t i = 0; i < s; ++i) {
+        const int own = labels[sample[i]];
+        if (own < 0 || cluster_size[own] < 2) continue;   // singletons score 0
+
+        std::fill(cluster_total.begin(), cluster_total.end(), 0.0);
+        for (size_t j = 0; j < s; ++j) {
+            const int other = labels[sample[j]];
+            if (j == i || other < 0) continue;
+            double dx = column_x[sample[i]] - column_x[sample[j]];
+            double dy = column_y[sample[i]] - column_y[sample[j]];
+            cluster_total[other] += std::sqrt(dx * dx + dy * dy);
+        }
+
+        const double a = cluster_total[own] / (cluster_size[own] - 1);
+        double b = std::numeric_limits<double>::infinity();
+        for (size_t c = 0; c < k; ++c) {
+            if ((int)c != own && cluster_size[c] > 0) b = std::min(b, cluster_total[c] / cluster_size[c]);
+        }
+        if (std::isfinite(b) && std::max(a, b) > 0) sum += (b - a) / std::max(a, b);
+        counted++;
+    }
+    return counted ? sum / s : 0.0;
+}
+
+static void run_sweep_job(SweepJob& job, const std::vector<size_t>& sample) {
+    auto start = std::chrono::steady_clock::now();
+    const size_t n = column_size;
+    const size_t k = std::min(job.k, n);
+
+    std::mt19937_64 rng(job.seed * 0x9e3779b97f4a7c15ULL + job.k);
+    SeedState seeding;
+    seeding.parallel = false;
+    std::vector<Centroid> cents = seed_kmeans_plus_plus(k, rng, seeding);
+    seeding = SeedState();
+
+    // Large K goes through the centroid tree, as in the main engine.
+    const bool use_tree = centroid_index == CentroidIndex::KdTree ||
+                          (centroid_index == CentroidIndex::Auto && k >= CENTROID_INDEX_THRESHOLD);
+    CentroidTree tree;
+    std::vector<double> cx(k), cy(k);
+    kmeans::Sums sums;
+    std::vector<int> labels(n, -1), nearest(n);
+    uint64_t tree_distances = 0;
+
+    while (job.iterations < options.max_iterations) {
+        if (use_tree) {
+            tree.build(cents);
+            for (size_t i = 0; i < n; ++i) {
+                nearest[i] = tree.nearest(column_x[i], column_y[i], labels[i], tree_distances);
+            }
+        } else {
+            for (size_t c = 0; c < k; ++c) {
+                cx[c] = cents[c].x;
+                cy[c] = cents[c].y;
+            }
+            assign_columns(assign_kernel, column_x, column_y, n, cx.data(), cy.data(), k, nearest.data());
+        }
+
+        size_t reassigned = 0;
+        for (size_t i = 0; i < n; ++i) {
+            reassigned += labels[i] != nearest[i];
+            labels[i] = nearest[i];
+        }
+        job.iterations++;
+        if (reassigned == 0) {
+            job.converged = true;
+            break;
+        }
+        // The core skips unassigned (-1) points.
+        sums.reset(k, 2);
+        kmeans::accumulate_range(point_view(), labels.data(), 0, n, sums);
+        for (size_t c = 0; c < k; ++c) {
+            if (sums.count[c] > 0) {
+                cents[c].x = sums.coords[2 * c] / sums.count[c];
+                cents[c].y = sums.coords[2 * c + 1] / sums.count[c];
+            }
+        }
+    }
+
+    job.inertia = kmeans::inertia_range(point_view(), centroid_model(cents), labels.data(), 0, n);
+    job.silhouette = sample_silhouette(sample, labels, k);
+    job.seconds = seconds_since(start);
+}
+
+int run_sweep() {
+    auto load_start = std::chrono::steady_clock::now();
+    if (!load_input()) {
+        return 1;
+    }
+    const double load_seconds = seconds_since(load_start);
+    const size_t n = column_size;
+    if (n == 0) {
+        std::cerr << "No points to cluster" << std::endl;
+        return 1;
+    }
+
+    std::vector<size_t> sample;
+    const size_t sample_size = std::min(options.silhouette_sample, n);
+    for (size_t j = 0; j < sample_size; ++j) {
+        sample.push_back(j * n / sample_size);
+    }
+
+    std::vector<SweepJob> jobs;
+    for (size_t k = options.sweep_min; k <= options.sweep_max; k += options.sweep_step) {
+        for (int r = 0; r < options.restarts; ++r) {
+            SweepJob job;
+            job.k = k;
+            job.seed = options.seed + r;
+            jobs.push_back(job);
+        }
+    }
+    std::stable_sort(jobs.begin(), jobs.end(), [](const SweepJob& a, const SweepJob& b) { return a.k > b.k; });
+
+    std::unique_ptr<WorkerPool> local_pool;
+    WorkerPool* pool = worker_pool.get();
+    if (!pool) {
+        local_pool.reset(new WorkerPool(std::max(1u, std::thread::hardware_concurrency())));
+        pool = local_pool.get();
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    pool->parallel_for(jobs.size(), [&](size_t j) { run_sweep_job(jobs[j], sample); });
+    const double wall = seconds_since(start);
+
+    std::stable_sort(jobs.begin(), jobs.end(), [](const SweepJob& a, const SweepJob& b) {
+        return a.k != b.k ? a.k < b.k : a.seed < b.seed;
+    });
+
+    std::cout << std::setprecision(6) << std::defaultfloat;
+    for (const SweepJob& job : jobs) {
+        std::cout << "{\"job\":\"run\",\"k\":" << job.k << ",\"seed\":" << job.seed
+                  << ",\"iterations\":" << job.iterations
+                  << ",\"converged\":" << (job.converged ? "true" : "false")
+                  << ",\"seconds\":" << job.seconds
+                  << ",\"silhouette\":" << job.silhouette
+                  << ",\"inertia\":" << std::setprecision(17) << job.inertia << std::setprecision(6)
+                  << "}\n";
+    }
+
+    // Per K: the best restart by inertia.
+    std::vector<const SweepJob*> best;
+    for (const SweepJob& job : jobs) {
+        if (best.empty() || best.back()->k != job.k) {
+            best.push_back(&job);
+        } else if (job.inertia < best.back()->inertia) {
+            best.back() = &job;
+        }
+    }
+
+    size_t elbow_k = best.front()->k, silhouette_k = best.front()->k;
+    double elbow_gap = -1.0, best_silhouette = -2.0;
+    const double k0 = best.front()->k, k1 = best.back()->k;
+    const double i0 = best.front()->inertia, i1 = best.back()->inertia;
+    for (const SweepJob* job : best) {
+        double line = k1 > k0 ? i0 + (i1 - i0) * (job->k - k0) / (k1 - k0) : i0;
+        double gap = line - job->inertia;
+        if (gap > elbow_gap) {
+            elbow_gap = gap;
+            elbow_k = job->k;
+        }
+        if (job->silhouette > best_silhouette) {
+            best_silhouette = job->silhouette;
+            silhouette_k = job->k;
+        }
+        std::cout << "{\"job\":\"k\",\"k\":" << job->k
+                  << ",\"best_seed\":" << job->seed
+                  << ",\"silhouette\":" << job->silhouette
+                  << ",\"inertia\":" << std::setprecision(17) << job->inertia << std::setprecision(6)
+                  << "}\n";
+    }
+
+    std::cout << "{\"job\":\"summary\",\"points\":" << n
+              << ",\"jobs\":" << jobs.size()
+              << ",\"threads\":" << pool->size()
+              << ",\"silhouette_sample\":" << sample.size()
+              << ",\"load_seconds\":" << load_seconds
+              << ",\"wall_seconds\":" << wall
+              << ",\"jobs_per_second\":" << (wall > 0 ? jobs.size() / wall : 0.0)
+              << ",\"elbow_k\":" << elbow_k
+              << ",\"best_silhouette_k\":" << silhouette_k
+              << ",\"peak_rss_kb\":" << peak_rss_kb()
+              << "}" << std::endl;
+    return 0;
+}
+
+// ---- Generic dimensions ----
+// Inputs that are not 2-D doubles run through the header-only core in
+// kmeans_core.h: binary point files whose header has another dimension, and
+// --generate with --dim/--dtype. The common dimensions are instantiated at
+// compile time; anything else uses kmeans::Dynamic. These runs are headless
+// only and iterate with kmeans::iterate on the worker pool. The 2-D engine
+// sums and scores through the same core and adds its SIMD kernels, pruning
+// and centroid index on top.
+
+// Reads just the header of a binary point file; false for text files.
+bool probe_point_file(const std::string& file_name, PointFileHeader& header) {
+    std::ifstream file(file_name, std::ios::binary);
+    return file.read((char*)&header, sizeof(header)) &&
+           memcmp(header.magic, POINT_FILE_MAGIC, sizeof(POINT_FILE_MAGIC)) == 0;
+}
+
+template <typename T>
+void generate_blobs_planar(size_t n, size_t k, size_t dim, uint64_t seed,
+                           std::vector<T>& planar, std::vector<T>& seeds) {
+    std::mt19937_64 rng(seed);
+    std::uniform_real_distribution<double> center_coord(-80.0, 80.0);
+    std::normal_distribution<double> spread(0.0, 6.0);
+    std::uniform_int_distribution<size_t> pick_blob(0, k - 1);
+
+    std::vector<double> centers(k * dim);
+    for (auto& c : centers) c = center_coord(rng);
+
+    planar.resize(n * dim);
+    for (size_t i = 0; i < n; ++i) {
+        const double* c = centers.data() + pick_blob(rng) * dim;
+        for (size_t d = 0; d < dim; ++d) {
+            planar[d * n + i] = (T)(c[d] + spread(rng));
+        }
+    }
+
+    seeds.clear();
+    std::uniform_int_distribution<size_t> pick_point(0, n - 1);
+    for (size_t c = 0; c < k; ++c) {
+        size_t i = pick_point(rng);
+        for (size_t d = 0; d < dim; ++d) seeds.push_back(planar[d * n + i]);
+    }
+}
+
+template <typename T>
+bool write_planar_file(const std::string& file_name, const std::vector<T>& planar, size_t n,
+                       size_t dim, const std::vector<T>& seeds) {
+    std::ofstream file(file_name, std::ios::binary);
+    if (!file) {
+        std::cerr << "Error writing " << file_name << std::endl;
+        return false;
+    }
+    const size_t k = dim ? seeds.size() / dim : 0;
+    PointFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, POINT_FILE_MAGIC, sizeof(header.magic));
+    header.version = 1;
+    header.num_points = n;
+    header.num_centroids = k;
+    header.dimension = dim;
+    header.dtype = sizeof(T) == sizeof(float) ? POINT_DTYPE_FLOAT32 : POINT_DTYPE_FLOAT64;
+    header.data_offset = sizeof(header);
+    file.write((const char*)&header, sizeof(header));
+    file.write((const char*)planar.data(), planar.size() * sizeof(T));
+
+    // Centroids are planar as well: every centroid's dimension 0, then dimension 1, ...
+    std::vector<T> columns(k * dim);
+    for (size_t c = 0; c < k; ++c) {
+        for (size_t d = 0; d < dim; ++d) columns[d * k + c] = seeds[c * dim + d];
+    }
+    file.write((const char*)columns.data(), columns.size() * sizeof(T));
+    return bool(file);
+}
+
+template <size_t D, typename T>
+int run_generic(const T* base, size_t n, size_t dim, const std::vector<T>& seeds, double load_seconds) {
+    kmeans::PlanarPoints<D, T> view;
+    view.base = base;
+    view.count = n;
+    view.dim = dim;
+
+    kmeans::Model<D, T> model;
+    model.dim = dim;
+    model.k = seeds.size() / dim;
+    model.centroids = seeds;
+
+    // The chunks' time is the assign phase; the merge and the mean are update.
+    kmeans::Workspace work;
+    PhaseTimes times;
+    auto run_chunks = [&](size_t num_chunks, const std::function<void(size_t)>& task) {
+        auto start = std::chrono::steady_clock::now();
+        if (worker_pool) {
+            worker_pool->parallel_for(num_chunks, task);
+        } else {
+            for (size_t chunk = 0; chunk < num_chunks; ++chunk) task(chunk);
+        }
+        times.assign += seconds_since(start);
+    };
+
+    auto run_start = std::chrono::steady_clock::now();
+    int iterations = 0;
+    bool converged = false;
+    while (iterations < options.max_iterations) {
+        auto phase_start = std::chrono::steady_clock::now();
+        const double assign_before = times.assign;
+        const bool changed = kmeans::iterate(view, model, work, PARALLEL_CHUNK_SIZE, run_chunks);
+        times.update += seconds_since(phase_start) - (times.assign - assign_before);
+
+        iterations++;
+        if (!changed) {
+            converged = true;
+            break;
+        }
+    }
+    const double run_seconds = seconds_since(run_start);
+    distances_computed += (uint64_t)n * model.k * iterations;
+
+    double inertia = 0.0;
+    std::vector<double> chunk_inertia((n + PARALLEL_CHUNK_SIZE - 1) / PARALLEL_CHUNK_SIZE);
+    for_each_chunk(n, [&](size_t chunk, size_t begin, size_t end) {
+        chunk_inertia[chunk] = kmeans::inertia_range(view, model, work.labels.data(), begin, end);
+    });
+    for (double value : chunk_inertia) inertia += value;
+
+    std::cout << std::setprecision(6) << std::defaultfloat
+              << "{\"mode\":\"lloyd\""
+              << ",\"input\":\"" << (options.generate_points ? "generated" : json_escape(options.input)) << "\""
+              << ",\"points\":" << n
+              << ",\"centroids\":" << model.k
+              << ",\"dimension\":" << dim
+              << ",\"dtype\":\"" << (sizeof(T) == sizeof(float) ? "float32" : "float64") << "\""
+              << ",\"specialised\":" << (D != kmeans::Dynamic ? "true" : "false")
+              << ",\"threads\":" << (worker_pool ? worker_pool->size() : 1)
+              << ",\"iterations\":" << iterations
+              << ",\"converged\":" << (converged ? "true" : "false")
+              << ",\"load_seconds\":" << load_seconds
+              << ",\"wall_seconds\":" << run_seconds
+              << ",\"points_per_second\":" << (run_seconds > 0 ? (double)n * iterations / run_seconds : 0.0)
+              << ",\"phases\":{\"assign\":" << times.assign << ",\"update\":" << times.update << "}"
+              << ",\"distances_computed\":" << distances_computed
+              << ",\"inertia\":" << std::setprecision(17) << inertia
+              << ",\"peak_rss_kb\":" << peak_rss_kb()
+              << "}" << std::endl;
+    return 0;
+}
+
+template <typename T>
+int run_generic_dim(const T* base, size_t n, size_t dim, const std::vector<T>& seeds, double load_seconds) {
+    switch (dim) {
+        case 2: return run_generic<2, T>(base, n, dim, seeds, load_seconds);
+        case 3: return run_generic<3, T>(base, n, dim, seeds, load_seconds);
+        case 4: return run_generic<4, T>(base, n, dim, seeds, load_seconds);
+        case 8: return run_generic<8, T>(base, n, dim, seeds, load_seconds);
+        case 16: return run_generic<16, T>(base, n, dim, seeds, load_seconds);
+        case 32: return run_generic<32, T>(base, n, dim, seeds, load_seconds);
+        case 64: return run_generic<64, T>(base, n, dim, seeds, load_seconds);
+        case 128: return run_generic<128, T>(base, n, dim, seeds, load_seconds);
+        default: return run_generic<kmeans::Dynamic, T>(base, n, dim, seeds, load_seconds);
     }
 }
 
-static void on_back_clicked(GtkWidget* widget, gpointer data) {
-    if (is_paused && current_iteration > 1) {
-        current_iteration--;
-        if (current_iteration - 1 < point_history.size()) {
-            points = point_history[current_iteration - 1];
-            centroids = centroid_history[current_iteration - 1];
-            gtk_widget_queue_draw(GTK_WIDGET(data));
+// Starting centroids for a generic run: the file's centroid block, replaced
+// by --k distinct random points when --k is given or the file has none.
+template <typename T>
+std::vector<T> generic_seeds(const T* base, size_t n, size_t dim, const T* file_centroids, size_t file_k) {
+    std::vector<T> seeds;
+    if (options.k == 0 && file_k > 0) {
+        for (size_t c = 0; c < file_k; ++c) {
+            for (size_t d = 0; d < dim; ++d) seeds.push_back(file_centroids[d * file_k + c]);
         }
+        return seeds;
+    }
+    std::mt19937_64 rng(options.seed);
+    std::vector<size_t> order(n);
+    for (size_t i = 0; i < n; ++i) order[i] = i;
+    const size_t k = std::min(n, options.k ? options.k : (size_t)8);
+    for (size_t c = 0; c < k; ++c) {
+        std::swap(order[c], order[c + rng() % (n - c)]);
+        for (size_t d = 0; d < dim; ++d) seeds.push_back(base[d * n + order[c]]);
     }
+    return seeds;
 }
 
-static void on_speed_changed(GtkRange* range, gpointer user_data) {
-    iteration_speed = gtk_range_get_value(range);
+template <typename T>
+int run_generic_generated(size_t dim) {
+    auto start = std::chrono::steady_clock::now();
+    std::vector<T> planar, seeds;
+    generate_blobs_planar(options.generate_points, options.generate_centroids, dim, options.seed, planar, seeds);
+    if (!options.write_data.empty() && !write_planar_file(options.write_data, planar, options.generate_points, dim, seeds)) {
+        return 1;
+    }
+    if (options.k) {
+        seeds = generic_seeds<T>(planar.data(), options.generate_points, dim, nullptr, 0);
+    }
+    return run_generic_dim(planar.data(), options.generate_points, dim, seeds, seconds_since(start));
 }
 
-
-
-void print_iteration(int iteration) {
-    std::vector<int> cluster_sizes(centroids.size(), 0);
-
-    for (const auto& point : points) {
-        if (point.cluster != -1) {
-            cluster_sizes[point.cluster]++;
-        }
+template <typename T>
+int run_generic_mapped(const char* data, const PointFileHeader& header) {
+    const size_t n = header.num_points;
+    const size_t dim = header.dimension;
+    const T* base = (const T*)(data + header.data_offset);
+    std::vector<T> seeds = generic_seeds(base, n, dim, base + n * dim, header.num_centroids);
+    if (seeds.empty()) {
+        std::cerr << "No centroids in the input; use --k to seed them" << std::endl;
+        return 1;
     }
+    return run_generic_dim(base, n, dim, seeds, 0.0);
+}
 
-    std::cout << "\n=== Iteration " << iteration << " ===\n";
-    std::cout << "Number of centroids: " << centroids.size() << std::endl;
-    
-    for (size_t i = 0; i < centroids.size(); ++i) {
-        std::cout << "Centroid " << i + 1 << ": ("
-                  << std::fixed << std::setprecision(2) << centroids[i].x << ", " 
-                  << centroids[i].y << ") -> Points in cluster: " 
-                  << cluster_sizes[i] << "\n";
+// Entry point for --headless runs that need the generic core.
+int run_generic_headless() {
+    if (options.generate_points > 0) {
+        return options.dtype == POINT_DTYPE_FLOAT32 ? run_generic_generated<float>(options.dim)
+                                                    : run_generic_generated<double>(options.dim);
     }
 
-    std::cout << "\nPoint Assignments:\n";
-    for (size_t i = 0; i < points.size(); ++i) {
-        std::cout << "Point " << i + 1 << ": ("
-                  << std::fixed << std::setprecision(2) << points[i].x << ", " 
-                  << points[i].y << ") -> Cluster " 
-                  << points[i].cluster + 1 << "\n";
+    auto start = std::chrono::steady_clock::now();
+    int fd = open(options.input.c_str(), O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        if (fd >= 0) close(fd);
+        std::cerr << "Error opening file!" << std::endl;
+        return 1;
     }
-    std::cout << std::endl;
-}
-
-void read_from_file(const std::string& file_name) {
-    std::ifstream file(file_name);
-    if (!file) {
+    const size_t length = info.st_size;
+    void* base = length ? mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (base == MAP_FAILED) {
         std::cerr << "Error opening file!" << std::endl;
-        return;
+        return 1;
     }
 
-    points.clear();
-    centroids.clear();
-    centroid_history.clear();
-    point_history.clear();
-
-    int num_points;
-    file >> num_points;
-    
-    for (int i = 0; i < num_points; ++i) {
-        Point p;
-        if (file >> p.x >> p.y) {
-            p.cluster = -1;
-            points.push_back(p);
-        }
+    PointFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(&header, base, std::min(length, sizeof(header)));
+    const size_t elem = header.dtype == POINT_DTYPE_FLOAT64 ? sizeof(double)
+                      : header.dtype == POINT_DTYPE_FLOAT32 ? sizeof(float) : 0;
+    int status = 1;
+    if (length < sizeof(header) || header.version != 1 || elem == 0 || header.dimension == 0 ||
+        header.data_offset % elem != 0 || header.data_offset < sizeof(header) ||
+        header.data_offset > length ||
+        (length - header.data_offset) / elem / header.dimension < header.num_points + header.num_centroids) {
+        std::cerr << "Unsupported or truncated point file" << std::endl;
+    } else {
+        std::cerr << "Mapped " << header.num_points << " points of dimension " << header.dimension
+                  << " in " << seconds_since(start) << " s" << std::endl;
+        status = header.dtype == POINT_DTYPE_FLOAT32 ? run_generic_mapped<float>((const char*)base, header)
+                                                     : run_generic_mapped<double>((const char*)base, header);
     }
+    munmap(base, length);
+    return status;
+}
 
-    int num_centroids;
-    file >> num_centroids;
+// Runs to convergence (or --max-iterations) from the current state and prints
+// one JSON report line.
+void run_and_report(double load_seconds) {
+    phase_times = PhaseTimes();
+    distances_computed = 0;
+    distances_skipped = 0;
+    empty_reseeds = 0;
 
-    for (int i = 0; i < num_centroids; ++i) {
-        Centroid c;
-        if (file >> c.x >> c.y) {
-            centroids.push_back(c);
+    auto run_start = std::chrono::steady_clock::now();
+    int iterations = (int)resumed_iterations;
+    const int first_iteration = iterations;
+    bool converged = false;
+    while (iterations < options.max_iterations) {
+        bool progressed = options.minibatch ? minibatch_iteration() : kmeans_iteration();
+        iterations++;
+        log_iteration(iterations);
+        if (!progressed) {
+            converged = true;
+            break;
+        }
+        if (!checkpoint_after_iteration(iterations)) {
+            break;
         }
     }
+    const double run_seconds = seconds_since(run_start);
+    const uint64_t computed = distances_computed;
+    const uint64_t skipped = distances_skipped;
+    print_distance_counters(std::cerr);
+
+    double inertia;
+    size_t num_points;
+    if (options.minibatch) {
+        inertia = report_minibatch_quality(std::cerr);
+        num_points = point_stream.total();
+    } else {
+        inertia = batch_inertia();
+        num_points = points.size();
+    }
 
-    point_history.push_back(points);
-    centroid_history.push_back(centroids);
+    // Points visited per second of clustering; a mini-batch pass visits one batch.
+    const double visited = options.minibatch ? (double)points_streamed : (double)num_points * (iterations - first_iteration);
 
-    file.close();
+    std::cout << std::setprecision(6) << std::defaultfloat
+              << "{\"mode\":\"" << (options.minibatch ? "minibatch" : "lloyd") << "\""
+              << ",\"input\":\"" << (options.generate_points ? "generated" : json_escape(options.input)) << "\""
+              << ",\"points\":" << num_points
+              << ",\"centroids\":" << centroids.size()
+              << ",\"threads\":" << (worker_pool ? worker_pool->size() : 1)
+              << ",\"kernel\":\"" << assign_kernel_name(assign_kernel) << "\""
+              << ",\"prune\":\"" << options.prune << "\""
+              << ",\"index\":\"" << (centroid_index_active() && prune_mode == PruneMode::None
+                                         ? centroid_index_name(CentroidIndex::KdTree)
+                                         : centroid_index_name(CentroidIndex::None)) << "\""
+              << ",\"precision\":\"" << assign_precision_name(assign_precision) << "\""
+              << ",\"init\":\"" << init_mode_name(init_mode) << "\""
+              << ",\"update\":\"" << options.update << "\""
+              << ",\"iterations\":" << iterations
+              << ",\"converged\":" << (converged ? "true" : "false")
+              << ",\"load_seconds\":" << load_seconds
+              << ",\"init_seconds\":" << init_seconds
+              << ",\"wall_seconds\":" << run_seconds
+              << ",\"points_per_second\":" << (run_seconds > 0 ? visited / run_seconds : 0.0)
+              << ",\"phases\":{\"history\":" << phase_times.history
+              << ",\"assign\":" << phase_times.assign
+              << ",\"update\":" << phase_times.update << "}"
+              << ",\"distances_computed\":" << computed
+              << ",\"distances_skipped\":" << skipped
+              << ",\"exact_fallbacks\":" << exact_fallbacks
+              << ",\"empty_reseeds\":" << empty_reseeds
+              << ",\"inertia\":" << std::setprecision(17) << inertia
+              << ",\"peak_rss_kb\":" << peak_rss_kb()
+              << "}" << std::endl;
 }
 
-double calculate_distance(const Point& p, const Centroid& c) {
-    return std::sqrt(std::pow(p.x - c.x, 2) + std::pow(p.y - c.y, 2));
+int run_headless() {
+    PointFileHeader header;
+    if (!options.minibatch && (options.generate_points > 0 ? options.dim != 2 || options.dtype != POINT_DTYPE_FLOAT64
+                                                           : probe_point_file(options.input, header) && header.dimension != 2)) {
+        return run_generic_headless();
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    if (!load_input()) {
+        return 1;
+    }
+    const double load_seconds = seconds_since(start) - init_seconds;
+    if (!resume_if_requested()) {
+        return 1;
+    }
+
+    if (!options.compare_init) {
+        run_and_report(load_seconds);
+        return 0;
+    }
+
+    // --compare-init: one report per seeding method on the same points.
+    const std::vector<Centroid> loaded = centroids;
+    const InitMode modes[] = { InitMode::File, InitMode::KMeansPlusPlus, InitMode::KMeansParallel };
+    for (InitMode mode : modes) {
+        if (mode == InitMode::File && loaded.empty()) continue;
+        init_mode = mode;
+        centroids = loaded;
+        for (auto& p : points) p.cluster = -1;
+        hamerly_reset();
+        mark_points_changed();
+        seed_centroids(mode, options.k ? options.k : loaded.size(), options.seed);
+        run_and_report(load_seconds);
+    }
+    return 0;
 }
 
-bool kmeans_iteration() {
-    bool changed = false;
-    const size_t num_centroids = centroids.size();
+// ---- Frame snapshots ----
+// The k-means thread owns points/centroids; the draw callback never reads
+// them. After each iteration the k-means thread copies what the renderer
+// needs into a FrameSnapshot and publishes it through a triple buffer: the
+// writer fills its back slot and swaps it into the shared middle slot with
+// one atomic exchange, and the reader swaps the middle slot out for its front
+// slot only when a fresh one is waiting. Each side always has a slot of its
+// own, so neither waits for the other and the renderer never sees a half
+// written frame. Slots are reused, so publishing does not allocate once the
+// vectors have grown.
 
-    point_history.push_back(points);
-    centroid_history.push_back(centroids);
+void mark_points_changed() {
+    points_version++;
+}
 
-    for (auto& point : points) {
-        int closest_cluster = -1;
-        double min_distance = std::numeric_limits<double>::max();
+struct FrameSnapshot {
+    uint64_t version = 0;               // points_version at publication
+    int iteration = 1;
+    size_t count = 0;
+    const double* xs = nullptr;         // point coordinates, see publish_frame
+    const double* ys = nullptr;
+    std::vector<double> own_xs, own_ys;
+    std::vector<int> labels;
+    std::vector<Centroid> centroids;
+    long long batches_done = 0;
+    long long points_streamed = 0;
+    int epoch = 0;
+    ProfileSummary profile;
+};
 
-        for (size_t i = 0; i < num_centroids; ++i) {
-            double distance = calculate_distance(point, centroids[i]);
-            if (distance < min_distance) {
-                min_distance = distance;
-                closest_cluster = i;
-            }
-        }
+class FrameExchange {
+public:
+    // Writer side: the slot to fill, then publish() to hand it over.
+    FrameSnapshot& back() { return slots[back_slot]; }
 
-        if (point.cluster != closest_cluster) {
-            point.cluster = closest_cluster;
-            changed = true;
-        }
+    void publish() {
+        back_slot = middle.exchange(back_slot | FRESH, std::memory_order_acq_rel) & SLOT_MASK;
     }
 
-    std::vector<double> sum_x(num_centroids, 0.0);
-    std::vector<double> sum_y(num_centroids, 0.0);
-    std::vector<int> count(num_centroids, 0);
+    // True while a published frame has not been acquired yet.
+    bool pending() const { return middle.load(std::memory_order_relaxed) & FRESH; }
 
-    for (const auto& point : points) {
-        if (point.cluster >= 0 && point.cluster < num_centroids) {
-            sum_x[point.cluster] += point.x;
-            sum_y[point.cluster] += point.y;
-            count[point.cluster]++;
+    // Reader side: the newest published frame (or the previous one if
+    // nothing new has been published since).
+    const FrameSnapshot& acquire() {
+        if (middle.load(std::memory_order_relaxed) & FRESH) {
+            front_slot = middle.exchange(front_slot, std::memory_order_acq_rel) & SLOT_MASK;
         }
+        return slots[front_slot];
     }
 
-    for (size_t i = 0; i < num_centroids; ++i) {
-        if (count[i] > 0) {
-            centroids[i].x = sum_x[i] / count[i];
-            centroids[i].y = sum_y[i] / count[i];
-        }
+private:
+    static const unsigned SLOT_MASK = 3;
+    static const unsigned FRESH = 4;
+
+    FrameSnapshot slots[3];
+    unsigned back_slot = 0;             // writer only
+    unsigned front_slot = 1;            // reader only
+    std::atomic<unsigned> middle{2};
+};
+
+FrameExchange frame_exchange;
+
+// Called from the k-means thread only. In full-batch mode the coordinate
+// columns are fixed once the run starts, so the snapshot just points at them;
+// mini-batch replaces the points every batch, so they are copied.
+void publish_frame() {
+    auto start = std::chrono::steady_clock::now();
+    if (column_size != points.size()) {
+        sync_point_columns();
     }
 
-    return changed;
+    FrameSnapshot& frame = frame_exchange.back();
+    const size_t n = std::min(points.size(), column_size);
+    frame.version = points_version;
+    frame.iteration = current_iteration;
+    frame.count = n;
+    if (options.minibatch) {
+        frame.own_xs.assign(column_x, column_x + n);
+        frame.own_ys.assign(column_y, column_y + n);
+        frame.xs = frame.own_xs.data();
+        frame.ys = frame.own_ys.data();
+    } else {
+        frame.xs = column_x;
+        frame.ys = column_y;
+    }
+    frame.labels.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+        frame.labels[i] = points[i].cluster;
+    }
+    frame.centroids = centroids;
+    frame.batches_done = batches_done;
+    frame.points_streamed = points_streamed;
+    frame.epoch = minibatch_epoch;
+    frame.profile = profile;
+    frame_exchange.publish();
+    profile[Phase::Publish].add(seconds_since(start));
 }
 
-static void on_draw(GtkDrawingArea* drawing_area, cairo_t* cr, int width, int height, gpointer user_data) {
+// ---- Rendering ----
+// The grid, axes and labels only depend on the widget size and are drawn once
+// into a cached surface. Points are splatted straight into the pixels of a
+// second cached surface that is rebuilt only when the assignments or the size
+// change (the frame's version). Disc size shrinks as the plot gets crowded, and
+// once there are more points than pixels each pixel shows the colour of its
+// latest cluster shaded by how many points landed there. Only the status
+// text and centroids are drawn with cairo on every frame. Everything here reads
+// the acquired FrameSnapshot, never the live clustering state.
+
+struct PlotTransform {
+    double scale, x_offset, y_offset;
+
+    PlotTransform(int width, int height) {
+        const double range = 100.0;
+        scale = std::min(width, height) / (2.0 * range);
+        x_offset = width / 2;
+        y_offset = height / 2;
+    }
+};
+
+static void draw_grid(cairo_t* cr, int width, int height) {
     cairo_set_source_rgb(cr, 1, 1, 1);
     cairo_paint(cr);
 
@@ -283,44 +4677,261 @@ static void on_draw(GtkDrawingArea* drawing_area, cairo_t* cr, int width, int he
             cairo_show_text(cr, text.c_str());
         }
     }
+}
+
+struct DensityCell {
+    uint32_t count;
+    int32_t cluster;    // latest point to land on the pixel
+};
+
+struct RenderCache {
+    cairo_surface_t* background = nullptr;
+    cairo_surface_t* point_layer = nullptr;
+    int width = 0, height = 0;
+    uint64_t version = UINT64_MAX;
+    size_t palette_size = SIZE_MAX;
+    std::vector<uint32_t> palette;      // ARGB32 per cluster, last entry for unassigned
+    std::vector<DensityCell> density;   // per-pixel hits in density mode
+    std::vector<uint32_t> alpha;        // 0..256 opacity by hit count
+};
+
+RenderCache render_cache;
+
+static uint32_t pack_rgb(double r, double g, double b) {
+    auto channel = [](double v) { return (uint32_t)std::lround(std::min(1.0, std::max(0.0, v)) * 255.0); };
+    return 0xff000000u | channel(r) << 16 | channel(g) << 8 | channel(b);
+}
+
+static void rebuild_palette(size_t num_centroids) {
+    render_cache.palette.resize(num_centroids + 1);
+    for (size_t i = 0; i < num_centroids; ++i) {
+        Color color = get_distinct_color(i, num_centroids);
+        render_cache.palette[i] = pack_rgb(color.r, color.g, color.b);
+    }
+    render_cache.palette[num_centroids] = pack_rgb(0.7, 0.7, 0.7);
+    render_cache.palette_size = num_centroids;
+}
+
+static void render_point_layer(const FrameSnapshot& frame, int width, int height) {
+    cairo_surface_t* surface = render_cache.point_layer;
+    cairo_surface_flush(surface);
+    uint8_t* data = cairo_image_surface_get_data(surface);
+    const int stride = cairo_image_surface_get_stride(surface);
+    memset(data, 0, (size_t)stride * height);
+
+    const size_t n = frame.count;
+    const double* xs = frame.xs;
+    const double* ys = frame.ys;
+    const int* labels = frame.labels.data();
+    const size_t k = render_cache.palette_size;
+    const std::vector<uint32_t>& palette = render_cache.palette;
+    PlotTransform plot(width, height);
+    auto color_of = [&](int cluster) {
+        return palette[cluster >= 0 && (size_t)cluster < k ? cluster : k];
+    };
+
+    const size_t pixels = (size_t)width * height;
+    if (n > pixels) {
+        render_cache.density.assign(pixels, DensityCell{0, -1});
+        DensityCell* cells = render_cache.density.data();
+        uint32_t max_count = 1;
+        for (size_t i = 0; i < n; ++i) {
+            // Bounds are checked before the cast: far outside the view the
+            // coordinate does not fit in an int. The negated test also drops NaN.
+            const double fx = plot.x_offset + xs[i] * plot.scale;
+            const double fy = plot.y_offset - ys[i] * plot.scale;
+            if (!(fx > -1.0 && fy > -1.0 && fx < width && fy < height)) continue;
+            const int px = (int)fx, py = (int)fy;
+            DensityCell& cell = cells[(size_t)py * width + px];
+            cell.count++;
+            cell.cluster = labels[i];
+            max_count = std::max(max_count, cell.count);
+        }
+
+        // Log-scaled opacity over white so sparse pixels stay visible.
+        std::vector<uint32_t>& alpha = render_cache.alpha;
+        alpha.resize(max_count + 1);
+        const double log_max = std::log1p((double)max_count);
+        for (uint32_t c = 1; c <= max_count; ++c) {
+            alpha[c] = (uint32_t)std::lround(256.0 * (0.35 + 0.65 * std::log1p((double)c) / log_max));
+        }
+
+        for (int y = 0; y < height; ++y) {
+            uint32_t* row = (uint32_t*)(data + (size_t)y * stride);
+            const DensityCell* cell_row = cells + (size_t)y * width;
+            for (int x = 0; x < width; ++x) {
+                if (cell_row[x].count == 0) continue;
+                const uint32_t a = alpha[cell_row[x].count];
+                const uint32_t c = color_of(cell_row[x].cluster);
+                uint32_t pixel = 0xff000000u;
+                for (int shift = 0; shift <= 16; shift += 8) {
+                    uint32_t channel = (c >> shift) & 0xff;
+                    pixel |= ((255 * (256 - a) + channel * a) >> 8) << shift;
+                }
+                row[x] = pixel;
+            }
+        }
+        cairo_surface_mark_dirty(surface);
+        return;
+    }
+
+    // Shrink the disc until the points would cover at most ~4x the plot area.
+    int radius = (int)(std::min(width, height) / 100.0);
+    while (radius > 0 && (double)n * (2 * radius + 1) * (2 * radius + 1) > 4.0 * pixels) {
+        radius--;
+    }
+    std::vector<std::pair<int, int>> disc;
+    for (int dy = -radius; dy <= radius; ++dy) {
+        for (int dx = -radius; dx <= radius; ++dx) {
+            if (dx * dx + dy * dy <= radius * radius) disc.emplace_back(dx, dy);
+        }
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        // Same test as px in [-radius, width + radius) after rounding, done
+        // on the doubles so only coordinates that fit reach the cast.
+        const double fx = plot.x_offset + xs[i] * plot.scale;
+        const double fy = plot.y_offset - ys[i] * plot.scale;
+        if (!(fx > -radius - 0.5 && fy > -radius - 0.5 && fx < width + radius - 0.5 && fy < height + radius - 0.5)) {
+            continue;
+        }
+        const int px = (int)std::lround(fx), py = (int)std::lround(fy);
+        uint32_t c = color_of(labels[i]);
+        if (px >= radius && py >= radius && px < width - radius && py < height - radius) {
+            for (const auto& offset : disc) {
+                ((uint32_t*)(data + (size_t)(py + offset.second) * stride))[px + offset.first] = c;
+            }
+        } else {
+            for (const auto& offset : disc) {
+                int x = px + offset.first, y = py + offset.second;
+                if (x < 0 || y < 0 || x >= width || y >= height) continue;
+                ((uint32_t*)(data + (size_t)y * stride))[x] = c;
+            }
+        }
+    }
+    cairo_surface_mark_dirty(surface);
+}
+
+static void update_render_cache(const FrameSnapshot& frame, int width, int height) {
+    if (width != render_cache.width || height != render_cache.height || !render_cache.background) {
+        if (render_cache.background) cairo_surface_destroy(render_cache.background);
+        if (render_cache.point_layer) cairo_surface_destroy(render_cache.point_layer);
+
+        render_cache.background = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+        cairo_t* bg = cairo_create(render_cache.background);
+        draw_grid(bg, width, height);
+        cairo_destroy(bg);
+
+        render_cache.point_layer = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+        render_cache.width = width;
+        render_cache.height = height;
+        render_cache.version = UINT64_MAX;
+    }
+
+    if (render_cache.palette_size != frame.centroids.size()) {
+        rebuild_palette(frame.centroids.size());
+        render_cache.version = UINT64_MAX;
+    }
+
+    if (render_cache.version != frame.version) {
+        render_point_layer(frame, width, height);
+        render_cache.version = frame.version;
+    }
+}
+
+// Renderer-side timings of on_draw; the k-means phases come with the frame.
+PhaseStats draw_stats;
+
+static void draw_profile_overlay(cairo_t* cr, const FrameSnapshot& frame, int width, int height) {
+    std::vector<std::string> lines;
+    char line[160];
+    snprintf(line, sizeof(line), "%-8s %9s %9s %9s %9s %9s", "phase", "last ms", "mean ms", "p50 <", "p95 <", "max ms");
+    lines.push_back(line);
+    for (size_t p = 0; p < NUM_PHASES; ++p) {
+        const Phase phase = (Phase)p;
+        const PhaseStats& stats = phase == Phase::Draw ? draw_stats : frame.profile[phase];
+        if (stats.samples == 0) continue;
+        snprintf(line, sizeof(line), "%-8s %9.3f %9.3f %9.3f %9.3f %9.3f", phase_name(phase),
+                 stats.last * 1e3, stats.mean() * 1e3, stats.quantile(0.5) * 1e3,
+                 stats.quantile(0.95) * 1e3, stats.max * 1e3);
+        lines.push_back(line);
+    }
+    const ProfileCounters& last = frame.profile.last;
+    snprintf(line, sizeof(line), "reassigned %llu  distances %llu  history +%llu B (%.1f MB total)",
+             (unsigned long long)last.reassigned, (unsigned long long)last.distances,
+             (unsigned long long)last.history_bytes, frame.profile.total.history_bytes / 1048576.0);
+    lines.push_back(line);
+
+    const double font_size = std::max(10.0, std::min(width, height) / 70.0);
+    const double line_height = font_size * 1.3;
+    const double box_width = font_size * 0.62 * 60;
+    const double box_height = line_height * lines.size() + font_size * 0.6;
+    const double x = 10, y = height - box_height - 10;
+
+    cairo_save(cr);
+    cairo_set_source_rgba(cr, 0, 0, 0, 0.7);
+    cairo_rectangle(cr, x, y, box_width, box_height);
+    cairo_fill(cr);
+    cairo_select_font_face(cr, "monospace", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
+    cairo_set_font_size(cr, font_size);
+    cairo_set_source_rgb(cr, 1, 1, 1);
+    for (size_t i = 0; i < lines.size(); ++i) {
+        cairo_move_to(cr, x + font_size * 0.4, y + line_height * (i + 1));
+        cairo_show_text(cr, lines[i].c_str());
+    }
+    cairo_restore(cr);
+}
+
+static void on_draw(GtkDrawingArea* drawing_area, cairo_t* cr, int width, int height, gpointer user_data) {
+    if (width <= 0 || height <= 0) return;
+    auto draw_start = std::chrono::steady_clock::now();
+
+    PlotTransform plot(width, height);
+    const double scale = plot.scale;
+    const double x_offset = plot.x_offset;
+    const double y_offset = plot.y_offset;
+
+    const FrameSnapshot& frame = frame_exchange.acquire();
+
+    update_render_cache(frame, width, height);
+    cairo_set_source_surface(cr, render_cache.background, 0, 0);
+    cairo_paint(cr);
+    cairo_set_source_surface(cr, render_cache.point_layer, 0, 0);
+    cairo_paint(cr);
 
     // Display status information
     cairo_set_source_rgb(cr, 0.2, 0.2, 0.2);
     cairo_set_font_size(cr, std::min(width, height) / 30.0);
     
     std::string status = is_paused ? " (Paused - Use Step/Back)" : " (Running)";
-    std::string iter_text = "Iteration: " + std::to_string(current_iteration) + status;
+    std::string iter_text = "Iteration: " + std::to_string(frame.iteration) + status;
     cairo_move_to(cr, 20, 30);
     cairo_show_text(cr, iter_text.c_str());
 
-    std::string speed_text = "Speed: " + std::to_string(iteration_speed) + "ms";
+    std::string speed_text = max_speed ? std::string("Speed: max") : "Speed: " + std::to_string(iteration_speed) + "ms";
     cairo_move_to(cr, width - 150, 30);
     cairo_show_text(cr, speed_text.c_str());
 
     cairo_set_font_size(cr, std::min(width, height) / 40.0);
-    std::string info_text = "Points: " + std::to_string(points.size()) + 
-                           "  Centroids: " + std::to_string(centroids.size());
+    std::string info_text = "Points: " + std::to_string(frame.count) + 
+                           "  Centroids: " + std::to_string(frame.centroids.size());
     cairo_move_to(cr, 20, 60);
     cairo_show_text(cr, info_text.c_str());
 
-    // Draw points
-    double point_size = std::min(width, height) / 100.0;
-    for (const auto& point : points) {
-        if (point.cluster == -1) {
-            cairo_set_source_rgb(cr, 0.7, 0.7, 0.7);
-        } else {
-            Color color = get_distinct_color(point.cluster, centroids.size());
-            cairo_set_source_rgb(cr, color.r, color.g, color.b);
-        }
-        cairo_arc(cr, x_offset + point.x * scale, y_offset - point.y * scale, point_size, 0, 2 * M_PI);
-        cairo_fill(cr);
+    if (options.minibatch) {
+        std::string batch_text = "Batch: " + std::to_string(frame.batches_done) +
+                                 "  Points streamed: " + std::to_string(frame.points_streamed) +
+                                 " / " + std::to_string(point_stream.total()) +
+                                 "  Epoch: " + std::to_string(std::min(frame.epoch + 1, options.epochs));
+        cairo_move_to(cr, 20, 85);
+        cairo_show_text(cr, batch_text.c_str());
     }
 
     // Draw centroids
     double centroid_size = std::min(width, height) / 60.0;
-    for (size_t i = 0; i < centroids.size(); ++i) {
-        const auto& centroid = centroids[i];
-        Color color = get_distinct_color(i, centroids.size());
+    for (size_t i = 0; i < frame.centroids.size(); ++i) {
+        const auto& centroid = frame.centroids[i];
+        Color color = get_distinct_color(i, frame.centroids.size());
         cairo_set_source_rgb(cr, color.r * 0.7, color.g * 0.7, color.b * 0.7);
         
         double cx = x_offset + centroid.x * scale;
@@ -341,39 +4952,153 @@ static void on_draw(GtkDrawingArea* drawing_area, cairo_t* cr, int width, int he
         cairo_move_to(cr, cx - extents.width/2, cy + extents.height/2);
         cairo_show_text(cr, num.c_str());
     }
+
+    if (show_overlay) {
+        draw_profile_overlay(cr, frame, width, height);
+    }
+
+    const double draw_seconds = seconds_since(draw_start);
+    draw_stats.add(draw_seconds);
+    draw_frames++;
+    draw_nanoseconds += (uint64_t)(draw_seconds * 1e9);
+}
+
+// Runs on the GTK frame clock, so redraws follow the display refresh rate no
+// matter how often the k-means thread publishes.
+static gboolean on_frame_tick(GtkWidget* widget, GdkFrameClock* clock, gpointer data) {
+    if (frame_exchange.pending()) {
+        gtk_widget_queue_draw(widget);
+    }
+    return G_SOURCE_CONTINUE;
 }
 
-void run_kmeans(GtkWidget* drawing_area) {
-    centroid_history.clear();
-    point_history.clear();
-    
+// Steps back one iteration through the history; requested by the Back button.
+void step_back() {
+    if (current_iteration <= 1) return;
+    current_iteration--;
+    if (current_iteration - 1 < history.size()) {
+        history.restore(current_iteration - 1, points, centroids);
+        mark_points_changed();
+    }
+}
+
+// Blocks until the next iteration should run: immediately in max-speed mode,
+// iteration_speed ms after the previous one otherwise, or on Step while
+// paused. Back requests are served while waiting. The UI callbacks notify
+// run_wakeup, so pause, step, back and speed changes take effect at once.
+void wait_for_next_iteration(std::chrono::steady_clock::time_point last_iteration, bool& published) {
+    std::unique_lock<std::mutex> lock(run_mutex);
     while (true) {
-        gtk_widget_queue_draw(drawing_area);
-        
-        while (is_paused) {
-            if (step_requested) {
-                step_requested = false;
-                break;
+        if (checkpoint_signal) return;
+        if (back_requested.exchange(false)) {
+            lock.unlock();
+            step_back();
+            publish_frame();
+            published = true;
+            lock.lock();
+            continue;
+        }
+        if (is_paused) {
+            if (!published) {
+                // Max-speed mode may have skipped the latest frame.
+                lock.unlock();
+                publish_frame();
+                published = true;
+                lock.lock();
+                continue;
             }
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            if (step_requested.exchange(false)) return;
+            run_wakeup.wait(lock);
+            continue;
+        }
+        step_requested = false;   // Step only counts while paused
+        if (max_speed) return;
+
+        auto deadline = last_iteration + std::chrono::milliseconds(iteration_speed);
+        if (std::chrono::steady_clock::now() >= deadline) return;
+        run_wakeup.wait_until(lock, deadline);
+    }
+}
+
+// Queued from the k-means thread when a stop signal ends the run.
+gboolean quit_application(gpointer) {
+    g_application_quit(g_application_get_default());
+    return G_SOURCE_REMOVE;
+}
+
+// Runs on its own thread and never touches GTK: frames go out through
+// frame_exchange and on_frame_tick schedules the redraws. In max-speed mode a
+// frame is only published once the renderer has taken the previous one, so
+// the display samples the run instead of slowing it down.
+void run_kmeans() {
+    if (!resumed_iterations) history.clear();
+    auto last_iteration = std::chrono::steady_clock::now();
+    bool published = false;
+
+    while (true) {
+        if (!max_speed || !frame_exchange.pending()) {
+            publish_frame();
+            published = true;
         }
 
-        std::this_thread::sleep_for(std::chrono::milliseconds(iteration_speed));
+        wait_for_next_iteration(last_iteration, published);
+        if (checkpoint_signal) {
+            if (!checkpoint_while_idle(current_iteration - 1)) {
+                g_idle_add(quit_application, nullptr);
+                return;
+            }
+            continue;
+        }
+        last_iteration = std::chrono::steady_clock::now();
 
-        if (!kmeans_iteration()) {
+        bool progressed = options.minibatch ? minibatch_iteration() : kmeans_iteration();
+        log_iteration(current_iteration);
+        published = false;
+        if (!progressed) {
+            break;
+        }
+        if (!checkpoint_after_iteration(current_iteration)) {
+            g_idle_add(quit_application, nullptr);
             break;
         }
 
         current_iteration++;
     }
 
-    gtk_widget_queue_draw(drawing_area);
+    publish_frame();
     std::cout << "K-Means completed in " << current_iteration << " iterations." << std::endl;
+    print_distance_counters(std::cout);
+    if (options.minibatch) {
+        report_minibatch_quality(std::cout);
+        publish_frame();
+    }
+
+    // The GUI stays open after convergence; keep serving checkpoint signals.
+    // A stop signal that ended the run has already been served.
+    if (checkpoint_writer.path.empty() || checkpoint_signal == 2) return;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(run_mutex);
+            run_wakeup.wait(lock, [] { return checkpoint_signal != 0; });
+        }
+        if (!checkpoint_while_idle(current_iteration)) {
+            g_idle_add(quit_application, nullptr);
+            return;
+        }
+    }
 }
 
+// user_data points at the exit status, set to 1 when --resume fails; the
+// application then quits before any window exists, like a headless run.
 void on_activate(GtkApplication* app, gpointer user_data) {
     current_iteration = 1;
-    read_from_file("data3.txt");
+    load_input();
+    if (!resume_if_requested()) {
+        *(int*)user_data = 1;
+        g_application_quit(G_APPLICATION(app));
+        return;
+    }
+    current_iteration = (int)resumed_iterations + 1;
 
     GtkWidget* window = gtk_application_window_new(app);
     gtk_window_set_title(GTK_WINDOW(window), "K-Means Visualization");
@@ -388,6 +5113,7 @@ void on_activate(GtkApplication* app, gpointer user_data) {
     gtk_widget_set_vexpand(drawing_area, TRUE);
     gtk_box_append(GTK_BOX(vbox), drawing_area);
     gtk_drawing_area_set_draw_func(GTK_DRAWING_AREA(drawing_area), on_draw, nullptr, nullptr);
+    gtk_widget_add_tick_callback(drawing_area, on_frame_tick, nullptr, nullptr);
 
     // Create horizontal box for controls
     GtkWidget* hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
@@ -411,11 +5137,18 @@ void on_activate(GtkApplication* app, gpointer user_data) {
     gtk_box_append(GTK_BOX(speed_box), speed_slider);
     gtk_widget_set_size_request(speed_slider, 200, -1);
 
+    GtkWidget* max_speed_check = gtk_check_button_new_with_label("Max speed");
+    gtk_check_button_set_active(GTK_CHECK_BUTTON(max_speed_check), max_speed);
+    GtkWidget* overlay_check = gtk_check_button_new_with_label("Stats");
+    gtk_check_button_set_active(GTK_CHECK_BUTTON(overlay_check), show_overlay);
+
     // Add all controls to horizontal box
     gtk_box_append(GTK_BOX(hbox), pause_button);
     gtk_box_append(GTK_BOX(hbox), step_button);
     gtk_box_append(GTK_BOX(hbox), back_button);
     gtk_box_append(GTK_BOX(hbox), speed_box);
+    gtk_box_append(GTK_BOX(hbox), max_speed_check);
+    gtk_box_append(GTK_BOX(hbox), overlay_check);
 
     // Set margins and spacing
     gtk_widget_set_margin_start(hbox, 5);
@@ -424,10 +5157,12 @@ void on_activate(GtkApplication* app, gpointer user_data) {
     gtk_widget_set_margin_start(speed_box, 20);
 
     // Connect signals
-    g_signal_connect(pause_button, "clicked", G_CALLBACK(on_pause_clicked), nullptr);
+    g_signal_connect(pause_button, "clicked", G_CALLBACK(on_pause_clicked), drawing_area);
     g_signal_connect(step_button, "clicked", G_CALLBACK(on_step_clicked), nullptr);
-    g_signal_connect(back_button, "clicked", G_CALLBACK(on_back_clicked), drawing_area);
-    g_signal_connect(speed_slider, "value-changed", G_CALLBACK(on_speed_changed), nullptr);
+    g_signal_connect(back_button, "clicked", G_CALLBACK(on_back_clicked), nullptr);
+    g_signal_connect(speed_slider, "value-changed", G_CALLBACK(on_speed_changed), drawing_area);
+    g_signal_connect(max_speed_check, "toggled", G_CALLBACK(on_max_speed_toggled), drawing_area);
+    g_signal_connect(overlay_check, "toggled", G_CALLBACK(on_overlay_toggled), drawing_area);
 
     // Style adjustments
     gtk_widget_set_size_request(pause_button, 80, 30);
@@ -437,16 +5172,385 @@ void on_activate(GtkApplication* app, gpointer user_data) {
     gtk_window_present(GTK_WINDOW(window));
 
     // Run K-Means in a separate thread
-    std::thread kmeans_thread(run_kmeans, drawing_area);
+    std::thread kmeans_thread(run_kmeans);
     kmeans_thread.detach();
 }
 
+static bool option_value(const char* arg, const char* name, std::string& value) {
+    size_t len = strlen(name);
+    if (strncmp(arg, name, len) != 0) return false;
+    if (arg[len] == '\0') { value.clear(); return true; }
+    if (arg[len] != '=') return false;
+    value = arg + len + 1;
+    return true;
+}
+
+bool parse_options(int& argc, char** argv) {
+    int kept = 1;
+    for (int i = 1; i < argc; ++i) {
+        std::string value;
+        if (option_value(argv[i], "--kernel", value)) {
+            options.kernel = value;
+        } else if (option_value(argv[i], "--precision", value)) {
+            options.precision = value;
+        } else if (option_value(argv[i], "--input", value)) {
+            options.input = value;
+        } else if (option_value(argv[i], "--minibatch", value)) {
+            // --minibatch=BATCH_SIZE streams the input instead of loading it
+            long long n = value.empty() ? 1024 : atoll(value.c_str());
+            if (n <= 0) {
+                std::cerr << "Invalid batch size '" << value << "'" << std::endl;
+                return false;
+            }
+            options.minibatch = n;
+        } else if (option_value(argv[i], "--epochs", value)) {
+            options.epochs = std::max(1, atoi(value.c_str()));
+        } else if (option_value(argv[i], "--compare-full", value)) {
+            options.compare_full = true;
+        } else if (option_value(argv[i], "--headless", value)) {
+            options.headless = true;
+        } else if (option_value(argv[i], "--max-speed", value)) {
+            options.max_speed = true;
+        } else if (option_value(argv[i], "--overlay", value)) {
+            options.overlay = true;
+        } else if (option_value(argv[i], "--profile", value)) {
+            options.profile = value;
+        } else if (option_value(argv[i], "--log", value)) {
+            options.log = value;
+        } else if (option_value(argv[i], "--log-file", value)) {
+            options.log_file = value;
+        } else if (option_value(argv[i], "--log-sample", value)) {
+            options.log_sample = std::max(1LL, atoll(value.c_str()));
+        } else if (option_value(argv[i], "--max-iterations", value)) {
+            options.max_iterations = std::max(1, atoi(value.c_str()));
+        } else if (option_value(argv[i], "--history", value)) {
+            options.history = true;
+        } else if (option_value(argv[i], "--generate", value)) {
+            // --generate=POINTS[,CENTROIDS[,SEED]]
+            unsigned long long n = 0, k = 0, seed = 0;
+            int fields = sscanf(value.c_str(), "%llu,%llu,%llu", &n, &k, &seed);
+            if (fields < 1 || n == 0 || (fields >= 2 && k == 0)) {
+                std::cerr << "Invalid --generate '" << value << "' (expected POINTS[,CENTROIDS[,SEED]])" << std::endl;
+                return false;
+            }
+            options.generate_points = n;
+            if (fields >= 2) options.generate_centroids = k;
+            if (fields >= 3) options.seed = seed;
+        } else if (option_value(argv[i], "--seed", value)) {
+            options.seed = strtoull(value.c_str(), nullptr, 10);
+        } else if (option_value(argv[i], "--write-data", value)) {
+            options.write_data = value;
+        } else if (option_value(argv[i], "--convert", value)) {
+            // --convert=INPUT,OUTPUT[,float32]
+            size_t comma = value.find(',');
+            if (comma == std::string::npos) {
+                std::cerr << "Invalid --convert '" << value << "' (expected INPUT,OUTPUT[,float32|float64])" << std::endl;
+                return false;
+            }
+            options.convert_input = value.substr(0, comma);
+            options.convert_output = value.substr(comma + 1);
+            comma = options.convert_output.find(',');
+            if (comma != std::string::npos) {
+                std::string dtype = options.convert_output.substr(comma + 1);
+                options.convert_output.resize(comma);
+                if (dtype == "float32") {
+                    options.convert_dtype = POINT_DTYPE_FLOAT32;
+                } else if (dtype != "float64") {
+                    std::cerr << "Unknown dtype '" << dtype << "' (expected float64 or float32)" << std::endl;
+                    return false;
+                }
+            }
+        } else if (option_value(argv[i], "--snapshot-interval", value)) {
+            // Full label snapshot every N history entries; deltas in between
+            options.snapshot_interval = std::max(1, atoi(value.c_str()));
+        } else if (option_value(argv[i], "--init", value)) {
+            options.init = value;
+        } else if (option_value(argv[i], "--k", value)) {
+            options.k = strtoull(value.c_str(), nullptr, 10);
+        } else if (option_value(argv[i], "--empty", value)) {
+            options.empty = value;
+        } else if (option_value(argv[i], "--sweep", value)) {
+            // --sweep=KMIN-KMAX[:STEP]
+            unsigned long long lo = 0, hi = 0, step = 1;
+            int fields = sscanf(value.c_str(), "%llu-%llu:%llu", &lo, &hi, &step);
+            if (fields < 2 || lo == 0 || hi < lo || step == 0) {
+                std::cerr << "Invalid --sweep '" << value << "' (expected KMIN-KMAX[:STEP])" << std::endl;
+                return false;
+            }
+            options.sweep_min = lo;
+            options.sweep_max = hi;
+            options.sweep_step = step;
+            options.headless = true;
+        } else if (option_value(argv[i], "--restarts", value)) {
+            options.restarts = std::max(1, atoi(value.c_str()));
+        } else if (option_value(argv[i], "--silhouette-sample", value)) {
+            options.silhouette_sample = std::max(2LL, atoll(value.c_str()));
+        } else if (option_value(argv[i], "--shards", value)) {
+            long long n = atoll(value.c_str());
+            if (n <= 0) {
+                std::cerr << "Invalid worker count '" << value << "'" << std::endl;
+                return false;
+            }
+            options.shards = n;
+            options.headless = true;    // sharded runs have no GUI
+        } else if (option_value(argv[i], "--shard-scaling", value)) {
+            options.shard_scaling = value.empty() ? 16 : std::max(1LL, atoll(value.c_str()));
+            options.headless = true;
+        } else if (option_value(argv[i], "--transport", value)) {
+            options.transport = value;
+        } else if (option_value(argv[i], "--checkpoint", value)) {
+            options.checkpoint = value;
+        } else if (option_value(argv[i], "--checkpoint-every", value)) {
+            options.checkpoint_every = std::max(0, atoi(value.c_str()));
+        } else if (option_value(argv[i], "--resume", value)) {
+            options.resume = value;
+        } else if (option_value(argv[i], "--update", value)) {
+            options.update = value;
+        } else if (option_value(argv[i], "--resum-interval", value)) {
+            options.resum_interval = std::max(1, atoi(value.c_str()));
+        } else if (option_value(argv[i], "--compare-init", value)) {
+            options.compare_init = true;
+        } else if (option_value(argv[i], "--dim", value)) {
+            long long d = atoll(value.c_str());
+            if (d <= 0) {
+                std::cerr << "Invalid dimension '" << value << "'" << std::endl;
+                return false;
+            }
+            options.dim = d;
+        } else if (option_value(argv[i], "--dtype", value)) {
+            if (value == "float32") {
+                options.dtype = POINT_DTYPE_FLOAT32;
+            } else if (value == "float64") {
+                options.dtype = POINT_DTYPE_FLOAT64;
+            } else {
+                std::cerr << "Unknown dtype '" << value << "' (expected float64 or float32)" << std::endl;
+                return false;
+            }
+        } else if (option_value(argv[i], "--prune", value)) {
+            options.prune = value;
+        } else if (option_value(argv[i], "--index", value)) {
+            options.index = value;
+        } else if (option_value(argv[i], "--threads", value)) {
+            // --threads=N or --threads=auto for one per hardware thread
+            if (value.empty() || value == "auto") {
+                options.threads = std::max(1u, std::thread::hardware_concurrency());
+            } else {
+                int n = atoi(value.c_str());
+                if (n <= 0) {
+                    std::cerr << "Invalid thread count '" << value << "'" << std::endl;
+                    return false;
+                }
+                options.threads = n;
+            }
+        } else if (option_value(argv[i], "--bench-assign", value)) {
+            options.bench_assign = true;
+            if (!value.empty()) {
+                // --bench-assign=POINTS[,CENTROIDS[,REPEATS]]
+                unsigned long long n = 0, k = 0;
+                int r = 0;
+                int fields = sscanf(value.c_str(), "%llu,%llu,%d", &n, &k, &r);
+                if (fields >= 1 && n > 0) options.bench_points = n;
+                if (fields >= 2 && k > 0) options.bench_centroids = k;
+                if (fields >= 3 && r > 0) options.bench_repeats = r;
+            }
+        } else {
+            argv[kept++] = argv[i];
+        }
+    }
+    argc = kept;
+    argv[argc] = nullptr;
+
+    if (options.prune == "none") {
+        prune_mode = PruneMode::None;
+    } else if (options.prune == "hamerly") {
+        prune_mode = PruneMode::Hamerly;
+    } else {
+        std::cerr << "Unknown prune mode '" << options.prune << "' (expected none or hamerly)" << std::endl;
+        return false;
+    }
+
+    if (options.precision == "double") {
+        assign_precision = AssignPrecision::Double;
+    } else if (options.precision == "mixed") {
+        assign_precision = AssignPrecision::Mixed;
+    } else {
+        std::cerr << "Unknown precision '" << options.precision << "' (expected double or mixed)" << std::endl;
+        return false;
+    }
+    if (assign_precision == AssignPrecision::Mixed && (prune_mode != PruneMode::None || options.minibatch)) {
+        std::cerr << "--precision=mixed cannot be combined with --prune or --minibatch" << std::endl;
+        return false;
+    }
+
+    const CentroidIndex index_modes[] = { CentroidIndex::None, CentroidIndex::Auto, CentroidIndex::KdTree };
+    bool index_found = false;
+    for (CentroidIndex mode : index_modes) {
+        if (options.index == centroid_index_name(mode)) {
+            centroid_index = mode;
+            index_found = true;
+        }
+    }
+    if (!index_found) {
+        std::cerr << "Unknown centroid index '" << options.index << "' (expected auto, none or kdtree)" << std::endl;
+        return false;
+    }
+
+    const InitMode init_modes[] = { InitMode::File, InitMode::KMeansPlusPlus, InitMode::KMeansParallel };
+    bool init_found = false;
+    for (InitMode mode : init_modes) {
+        if (options.init == init_mode_name(mode)) {
+            init_mode = mode;
+            init_found = true;
+        }
+    }
+    if (!init_found) {
+        std::cerr << "Unknown init mode '" << options.init << "' (expected file, kmeans++ or kmeans||)" << std::endl;
+        return false;
+    }
+    if (init_mode != InitMode::File && options.minibatch) {
+        std::cerr << "--init needs the whole point set and cannot be combined with --minibatch" << std::endl;
+        return false;
+    }
+
+    const LogMode log_modes[] = { LogMode::Off, LogMode::Summary, LogMode::Sample, LogMode::Full, LogMode::Binary };
+    if (options.log.empty()) options.log = log_mode_name(options.headless ? LogMode::Off : LogMode::Summary);
+    bool log_found = false;
+    for (LogMode mode : log_modes) {
+        if (options.log == log_mode_name(mode)) {
+            log_mode = mode;
+            log_found = true;
+        }
+    }
+    if (!log_found) {
+        std::cerr << "Unknown log mode '" << options.log << "' (expected off, summary, sample, full or binary)" << std::endl;
+        return false;
+    }
+    if (log_mode == LogMode::Binary && (options.log_file.empty() || options.log_file == "-")) {
+        std::cerr << "--log=binary needs --log-file=PATH" << std::endl;
+        return false;
+    }
+
+    if (options.transport == "socket") {
+        shard_transport = TransportKind::Socket;
+    } else if (options.transport == "shm") {
+        shard_transport = TransportKind::SharedMemory;
+    } else {
+        std::cerr << "Unknown transport '" << options.transport << "' (expected socket or shm)" << std::endl;
+        return false;
+    }
+    if ((options.shards || options.shard_scaling || options.sweep_min) && options.minibatch) {
+        std::cerr << "--shards and --sweep cannot be combined with --minibatch" << std::endl;
+        return false;
+    }
+
+    if ((!options.checkpoint.empty() || !options.resume.empty()) &&
+        (options.minibatch || options.shards || options.shard_scaling || options.sweep_min || options.compare_init)) {
+        std::cerr << "--checkpoint and --resume only apply to a single full-batch run" << std::endl;
+        return false;
+    }
+    if (options.checkpoint.empty() && options.checkpoint_every) {
+        std::cerr << "--checkpoint-every needs --checkpoint=PATH" << std::endl;
+        return false;
+    }
+
+    if (options.update == "full") {
+        update_mode = UpdateMode::Full;
+    } else if (options.update == "incremental") {
+        update_mode = UpdateMode::Incremental;
+    } else {
+        std::cerr << "Unknown update mode '" << options.update << "' (expected full or incremental)" << std::endl;
+        return false;
+    }
+    cluster_sums.resum_interval = options.resum_interval;
+
+    if (options.empty == "keep") {
+        empty_policy = EmptyPolicy::Keep;
+    } else if (options.empty == "farthest") {
+        empty_policy = EmptyPolicy::Farthest;
+    } else if (options.empty == "random") {
+        empty_policy = EmptyPolicy::Random;
+    } else {
+        std::cerr << "Unknown empty-cluster policy '" << options.empty << "' (expected keep, farthest or random)" << std::endl;
+        return false;
+    }
+
+    if (options.kernel == "auto") {
+        assign_kernel = detect_assign_kernel();
+    } else {
+        const AssignKernel kernels[] = { AssignKernel::Reference, AssignKernel::Scalar,
+                                         AssignKernel::SSE2, AssignKernel::AVX2 };
+        bool found = false;
+        for (AssignKernel kernel : kernels) {
+            if (options.kernel == assign_kernel_name(kernel)) {
+                found = true;
+                assign_kernel = kernel;
+            }
+        }
+        if (!found) {
+            std::cerr << "Unknown kernel '" << options.kernel
+                      << "' (expected auto, reference, scalar, sse2 or avx2)" << std::endl;
+            return false;
+        }
+        if (!assign_kernel_supported(assign_kernel)) {
+            std::cerr << "Kernel '" << options.kernel << "' is not supported on this CPU" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
 int main(int argc, char* argv[]) {
+    if (!parse_options(argc, argv)) {
+        return 1;
+    }
+
+    history.snapshot_interval = options.snapshot_interval;
+    max_speed = options.max_speed;
+    show_overlay = options.overlay;
+
+    if (!options.profile.empty()) {
+        profile_out.open(options.profile);
+        if (!profile_out) {
+            std::cerr << "Cannot open profile output '" << options.profile << "'" << std::endl;
+            return 1;
+        }
+    }
+
+    if (options.threads > 0) {
+        worker_pool.reset(new WorkerPool(options.threads));
+    }
+
+    if (options.bench_assign) {
+        return run_assign_benchmark(options.bench_points, options.bench_centroids, options.bench_repeats);
+    }
+
+    if (!options.convert_input.empty()) {
+        return run_convert(options.convert_input, options.convert_output, options.convert_dtype);
+    }
+
+    start_checkpoints();
+
+    const std::string log_path = options.log_file.empty() && !options.headless ? "-" : options.log_file;
+    if (!iteration_logger.start(log_mode, log_path, options.log_sample)) {
+        return 1;
+    }
+
+    if (options.headless) {
+        record_history = options.history;
+        int status = options.sweep_min ? run_sweep()
+                   : options.shards || options.shard_scaling ? run_sharded_headless()
+                   : run_headless();
+        iteration_logger.stop();
+        return status;
+    }
+
     GtkApplication* app = gtk_application_new("org.example.KMeansApp", G_APPLICATION_FLAGS_NONE);
-    g_signal_connect(app, "activate", G_CALLBACK(on_activate), nullptr);
+    int resume_status = 0;
+    g_signal_connect(app, "activate", G_CALLBACK(on_activate), &resume_status);
 
     int status = g_application_run(G_APPLICATION(app), argc, argv);
     g_object_unref(app);
+    iteration_logger.stop();
 
-    return status;
+    return status ? status : resume_status;
 }
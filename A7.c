@@ -1,108 +1,649 @@
 #include <gtk/gtk.h>
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
+#include <libavutil/cpu.h>
 #include <libavutil/imgutils.h>
+#include <libavutil/opt.h>
 #include <libswscale/swscale.h>
+#include <linux/futex.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
 #define BUFFER_SIZE 10  // Size of the circular buffer
+#define MAX_CONVERT_WORKERS 16
+#define FRAME_POOL_BASE (BUFFER_SIZE + 3)  // queued frames, one spare, two held by GTK
+#define FRAME_POOL_SIZE (FRAME_POOL_BASE + MAX_CONVERT_WORKERS)
+#define REORDER_WINDOW FRAME_POOL_SIZE
+#define PACKET_QUEUE_SIZE 64
+#define DECODED_QUEUE_SIZE 8
+#define PACKET_SHELLS (PACKET_QUEUE_SIZE + 2)                      // queued, being read, being decoded
+#define FRAME_SHELLS (DECODED_QUEUE_SIZE + MAX_CONVERT_WORKERS + 1)  // queued, converting, being decoded
+#define DEFAULT_CONVERT_WORKERS 2
+#define LATE_DROP_FRAMES 2          // decoder drops frames this many frame durations past due
+#define MAX_CONSECUTIVE_DROPS 8     // ...but converts at least every ninth frame
+
+// Converted frames are BGRA, byte for byte GDK's native premultiplied
+// format (alpha is always opaque), so GTK uploads them without repacking.
+#define OUTPUT_FORMAT AV_PIX_FMT_BGRA
+#define OUTPUT_MEMORY_FORMAT GDK_MEMORY_B8G8R8A8_PREMULTIPLIED
+
+// Preallocated RGB frames shared by the decoder and the display. sws_scale
+// writes straight into a pool frame, the circular buffer passes the pointer
+// along, and the texture shown on screen borrows its pixels; the frame goes
+// back to the pool when the last reference is dropped. Nothing is allocated
+// or copied per frame once the pool is set up (a resize reallocates each
+// frame once).
+typedef struct FramePool FramePool;
 
 typedef struct {
     AVFrame *frame;
-    int filled;  
-} FrameBuffer;
+    FramePool *pool;
+    atomic_int refs;     // 0 = on the free list
+    double pts;          // presentation time in seconds from the stream start
+} PoolFrame;
+
+struct FramePool {
+    PoolFrame slots[FRAME_POOL_SIZE];
+    PoolFrame *free_slots[FRAME_POOL_SIZE];
+    int free_count;
+    int allocated;
+    int closing;         // set on shutdown; released frames are freed, not recycled
+    pthread_mutex_t mutex;
+    pthread_cond_t available;
+};
+
+// Single-producer/single-consumer queue from the converters to the GTK tick.
+// write_count and read_count only grow (slot = count % BUFFER_SIZE) and each
+// is written by one side only, published with release and read with acquire,
+// so neither side takes a lock. The display never waits: an empty ring means
+// "keep showing the previous frame". A producer facing a full ring sleeps on
+// the wake_seq futex; the consumer only makes the wake syscall when
+// producer_waiting says someone is asleep.
+typedef struct {
+    PoolFrame *slots[BUFFER_SIZE];
+    _Alignas(64) atomic_size_t write_count;   // decoder side
+    _Alignas(64) atomic_size_t read_count;    // display side
+    _Alignas(64) atomic_uint wake_seq;        // bumped before every wake
+    atomic_int producer_waiting;
+} FrameRing;
 
+// Fixed-capacity blocking queue between pipeline stages; items are copied in
+// and out by value.
 typedef struct {
-    FrameBuffer buffer[BUFFER_SIZE];
-    int write_index;
-    int read_index;
+    char *items;
+    size_t item_size;
+    int capacity;
+    int head;
     int count;
+    int closed;
     pthread_mutex_t mutex;
     pthread_cond_t not_full;
     pthread_cond_t not_empty;
-    int terminate;
-    float frame_rate;
+} BoundedQueue;
+
+// A decoded frame on its way to a converter. seq numbers the frames that
+// survived late dropping, in decode (= presentation) order.
+typedef struct {
+    AVFrame *frame;
+    double pts;
+    long seq;
+} DecodedFrame;
+
+// Per-stream timestamp state of the decode stage.
+typedef struct {
+    double time_base;
+    int64_t start_pts;
+    double frame_duration;
+    double pts;               // of the last decoded frame
+    int consecutive_drops;
+    long next_seq;
+} FrameTiming;
+
+// Presentation clock: a frame with timestamp pts is due at monotonic time
+// clock_base_us + pts. The display starts the clock when the first frame
+// arrives; until then clock_base_us is 0 and nothing counts as late.
+typedef struct {
+    FrameRing ring;
+    atomic_int terminate;
+    float frame_rate;    // only paces streams without timestamps or frame rate
     char *filename;
+    int decode_threads;  // libavcodec thread_count; 0 = one per core
+    int convert_workers;
+    int slice_threads;   // libswscale threads per conversion
+    int fit_to_widget;   // convert at the picture's size instead of the source's
+    atomic_int view_width, view_height;   // picture size in device pixels
+    FramePool pool;
+    BoundedQueue packets;          // demux -> decode
+    BoundedQueue decoded;          // decode -> convert
+    BoundedQueue free_packets;     // empty AVPacket shells, back to demux
+    BoundedQueue free_frames;      // empty AVFrame shells, back to decode
+    pthread_t decode_id;           // joins the other stages before it exits
+    int decode_started;
+    pthread_mutex_t reorder_mutex;
+    PoolFrame *reorder[REORDER_WINDOW];
+    long next_seq;                 // next frame the ring is waiting for
+    int draining;                  // a converter is moving frames into the ring
+    atomic_llong clock_base_us;
+    atomic_long frames_dropped;   // late frames the decoder skipped before conversion
+    long frames_late;             // queued frames overtaken before the display got to them
+    long frames_presented;
 } ThreadData;
 
 static ThreadData thread_data;
 static GtkWidget *frame_display;
-static guint timer_id = 0;
+static guint tick_id = 0;
 
-// Add a frame to the buffer
-static void add_frame_to_buffer(ThreadData *data, AVFrame *frame) {
-    pthread_mutex_lock(&data->mutex);
-    
-    // Wait until there's space in the buffer
-    while (data->count == BUFFER_SIZE && !data->terminate) {
-        pthread_cond_wait(&data->not_full, &data->mutex);
+static void frame_pool_init(FramePool *pool) {
+    memset(pool, 0, sizeof(FramePool));
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->available, NULL);
+}
+
+// Allocates count (<= FRAME_POOL_SIZE) pool frames; called by the decoder
+// once the size is known.
+static int frame_pool_alloc(FramePool *pool, int count, int width, int height, enum AVPixelFormat format) {
+    pthread_mutex_lock(&pool->mutex);
+    for (int i = 0; i < count; i++) {
+        PoolFrame *slot = &pool->slots[i];
+        slot->pool = pool;
+        atomic_init(&slot->refs, 0);
+        slot->frame = av_frame_alloc();
+        if (!slot->frame) {
+            break;
+        }
+        slot->frame->format = format;
+        slot->frame->width = width;
+        slot->frame->height = height;
+        if (av_frame_get_buffer(slot->frame, 0) < 0) {
+            av_frame_free(&slot->frame);
+            break;
+        }
+        pool->free_slots[pool->free_count++] = slot;
+        pool->allocated++;
     }
-    
-    if (data->terminate) {
-        pthread_mutex_unlock(&data->mutex);
+    int ok = pool->allocated == count;
+    pthread_mutex_unlock(&pool->mutex);
+    return ok ? 0 : -1;
+}
+
+// Takes a free frame with one reference, waiting while all of them are in
+// use. Returns NULL once the pool is closing.
+static PoolFrame *frame_pool_acquire(FramePool *pool) {
+    PoolFrame *slot = NULL;
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->free_count == 0 && !pool->closing) {
+        pthread_cond_wait(&pool->available, &pool->mutex);
+    }
+    if (!pool->closing) {
+        slot = pool->free_slots[--pool->free_count];
+        atomic_store(&slot->refs, 1);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return slot;
+}
+
+static void frame_pool_unref(PoolFrame *slot) {
+    if (atomic_fetch_sub(&slot->refs, 1) != 1) {
         return;
     }
-    
-    // Add the frame to the buffer
-    if (data->buffer[data->write_index].frame != NULL) {
-        av_frame_free(&data->buffer[data->write_index].frame);
+    FramePool *pool = slot->pool;
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->closing) {
+        av_frame_free(&slot->frame);
+    } else {
+        pool->free_slots[pool->free_count++] = slot;
+        pthread_cond_signal(&pool->available);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+// Frees the idle frames and wakes a converter waiting in frame_pool_acquire.
+// Frames still referenced (e.g. by a texture GTK has not dropped yet) are
+// freed by their last frame_pool_unref, so the mutex is left alive.
+static void frame_pool_close(FramePool *pool) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->closing = 1;
+    for (int i = 0; i < pool->free_count; i++) {
+        av_frame_free(&pool->free_slots[i]->frame);
+    }
+    pool->free_count = 0;
+    pthread_cond_broadcast(&pool->available);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+// Texture bytes destroy notify: the displayed frame is no longer needed.
+static void release_texture_frame(gpointer user_data) {
+    frame_pool_unref((PoolFrame *)user_data);
+}
+
+static void futex_wait(atomic_uint *word, unsigned value) {
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+static void futex_wake(atomic_uint *word) {
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+// Wakes the producer if it is (or is about to be) asleep in add_frame_to_buffer.
+static void wake_producer(FrameRing *ring) {
+    atomic_fetch_add(&ring->wake_seq, 1);
+    futex_wake(&ring->wake_seq);
+}
+
+// Add a frame to the buffer. The buffer takes over the caller's reference.
+static void add_frame_to_buffer(ThreadData *data, PoolFrame *frame) {
+    FrameRing *ring = &data->ring;
+    size_t write = atomic_load_explicit(&ring->write_count, memory_order_relaxed);
+    
+    // Wait until there's space in the buffer. wake_seq is read before the
+    // final check, so a wake that lands after the check makes futex_wait
+    // return at once instead of being lost; the fences pair with the one in
+    // get_frame_from_buffer.
+    while (!atomic_load(&data->terminate) &&
+           write - atomic_load_explicit(&ring->read_count, memory_order_acquire) == BUFFER_SIZE) {
+        unsigned seq = atomic_load(&ring->wake_seq);
+        atomic_store_explicit(&ring->producer_waiting, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (!atomic_load(&data->terminate) &&
+            write - atomic_load_explicit(&ring->read_count, memory_order_acquire) == BUFFER_SIZE) {
+            futex_wait(&ring->wake_seq, seq);
+        }
+        atomic_store_explicit(&ring->producer_waiting, 0, memory_order_relaxed);
     }
     
-    data->buffer[data->write_index].frame = av_frame_clone(frame);
-    data->buffer[data->write_index].filled = 1;
-    data->write_index = (data->write_index + 1) % BUFFER_SIZE;
-    data->count++;
+    if (atomic_load(&data->terminate)) {
+        frame_pool_unref(frame);
+        return;
+    }
     
-    pthread_cond_signal(&data->not_empty);
-    pthread_mutex_unlock(&data->mutex);
+    // Add the frame to the buffer
+    ring->slots[write % BUFFER_SIZE] = frame;
+    atomic_store_explicit(&ring->write_count, write + 1, memory_order_release);
 }
 
-// Get a frame from the buffer
-static AVFrame *get_frame_from_buffer(ThreadData *data) {
-    AVFrame *frame = NULL;
+// Oldest queued frame without removing it; NULL if the buffer is empty.
+static PoolFrame *peek_frame_from_buffer(ThreadData *data) {
+    FrameRing *ring = &data->ring;
+    size_t read = atomic_load_explicit(&ring->read_count, memory_order_relaxed);
     
-    pthread_mutex_lock(&data->mutex);
-    
-    // Wait until there's a frame in the buffer
-    while (data->count == 0 && !data->terminate) {
-        pthread_cond_wait(&data->not_empty, &data->mutex);
+    if (read == atomic_load_explicit(&ring->write_count, memory_order_acquire)) {
+        return NULL;
     }
+    return ring->slots[read % BUFFER_SIZE];
+}
+
+// Get a frame from the buffer without waiting; NULL if none is ready. The
+// caller owns the returned reference.
+static PoolFrame *get_frame_from_buffer(ThreadData *data) {
+    FrameRing *ring = &data->ring;
+    size_t read = atomic_load_explicit(&ring->read_count, memory_order_relaxed);
     
-    if (data->terminate) {
-        pthread_mutex_unlock(&data->mutex);
+    if (read == atomic_load_explicit(&ring->write_count, memory_order_acquire)) {
         return NULL;
     }
     
     // Get the frame from the buffer
-    if (data->buffer[data->read_index].filled) {
-        frame = data->buffer[data->read_index].frame;
-        data->buffer[data->read_index].frame = NULL;
-        data->buffer[data->read_index].filled = 0;
-        data->read_index = (data->read_index + 1) % BUFFER_SIZE;
-        data->count--;
-        
-        pthread_cond_signal(&data->not_full);
-    }
+    PoolFrame *frame = ring->slots[read % BUFFER_SIZE];
+    atomic_store_explicit(&ring->read_count, read + 1, memory_order_release);
     
-    pthread_mutex_unlock(&data->mutex);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ring->producer_waiting, memory_order_relaxed)) {
+        wake_producer(ring);
+    }
     return frame;
 }
 
-// Decoding thread function
+// Playback pipeline, one stage per thread:
+//   demux_thread   - av_read_frame, video packets into data->packets
+//   decode_thread  - opens everything, starts the other stages and decodes
+//                    with libavcodec frame + slice threading; frames that are
+//                    already late are dropped here, the rest are numbered and
+//                    go into data->decoded
+//   convert_thread - data->convert_workers of them, each with its own
+//                    SwsContext, converting into pool frames
+// Conversions can finish out of order, so finished frames wait in a reorder
+// window and are released to the ring strictly by sequence number, by one
+// converter at a time and outside the reorder lock. A
+// converter takes its pool frame before it takes a decoded frame, so the
+// frame the ring is waiting for is never stuck waiting for the pool, and every
+// sequence number between the next one due and the newest one handed out holds a
+// pool frame: the window never spans more than the pool.
+// Packets and decoded frames travel in shells the decode stage allocates up
+// front: a stage takes an empty AVPacket or AVFrame from data->free_packets or
+// data->free_frames, and whoever finishes with it drops the references and
+// hands the shell back. The free queues hold every shell, so giving one back
+// never blocks, and nothing is allocated per packet or frame.
+
+static int queue_init(BoundedQueue *queue, int capacity, size_t item_size) {
+    memset(queue, 0, sizeof(BoundedQueue));
+    queue->items = calloc(capacity, item_size);
+    if (!queue->items) {
+        return -1;
+    }
+    queue->capacity = capacity;
+    queue->item_size = item_size;
+    pthread_mutex_init(&queue->mutex, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    return 0;
+}
+
+// Copies item in, waiting for space. Returns -1 if the queue was closed, in
+// which case the caller still owns whatever the item refers to.
+static int queue_push(BoundedQueue *queue, const void *item) {
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->count == queue->capacity && !queue->closed) {
+        pthread_cond_wait(&queue->not_full, &queue->mutex);
+    }
+    if (queue->closed) {
+        pthread_mutex_unlock(&queue->mutex);
+        return -1;
+    }
+    int tail = (queue->head + queue->count) % queue->capacity;
+    memcpy(queue->items + (size_t)tail * queue->item_size, item, queue->item_size);
+    queue->count++;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->mutex);
+    return 0;
+}
+
+// Copies the oldest item out, waiting for one. Returns 0 once the queue is
+// closed and empty.
+static int queue_pop(BoundedQueue *queue, void *item) {
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->count == 0 && !queue->closed) {
+        pthread_cond_wait(&queue->not_empty, &queue->mutex);
+    }
+    if (queue->count == 0) {
+        pthread_mutex_unlock(&queue->mutex);
+        return 0;
+    }
+    memcpy(item, queue->items + (size_t)queue->head * queue->item_size, queue->item_size);
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    pthread_cond_signal(&queue->not_full);
+    pthread_mutex_unlock(&queue->mutex);
+    return 1;
+}
+
+// No more pushes; consumers drain what is left and then see the end.
+static void queue_close(BoundedQueue *queue) {
+    pthread_mutex_lock(&queue->mutex);
+    queue->closed = 1;
+    pthread_cond_broadcast(&queue->not_full);
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+// Drops the packet's data and returns the empty shell to the demuxer.
+static void recycle_packet(ThreadData *data, AVPacket *packet) {
+    av_packet_unref(packet);
+    queue_push(&data->free_packets, &packet);
+}
+
+// Drops the frame's data and returns the empty shell to the decoder.
+static void recycle_frame(ThreadData *data, AVFrame *frame) {
+    av_frame_unref(frame);
+    queue_push(&data->free_frames, &frame);
+}
+
+// Whether a frame is already LATE_DROP_FRAMES frame durations past due.
+static int frame_is_late(ThreadData *data, double pts, double frame_duration) {
+    int64_t base = atomic_load(&data->clock_base_us);
+    if (base == 0) {
+        return 0;
+    }
+    int64_t due = base + (int64_t)((pts + LATE_DROP_FRAMES * frame_duration) * 1e6);
+    return g_get_monotonic_time() > due;
+}
+
+typedef struct {
+    ThreadData *data;
+    AVFormatContext *fmt_ctx;
+    int video_stream_index;
+} DemuxArgs;
+
+static void *demux_thread(void *arg) {
+    DemuxArgs *args = (DemuxArgs *)arg;
+    ThreadData *data = args->data;
+    AVPacket *packet;
+    
+    while (!data->terminate && queue_pop(&data->free_packets, &packet)) {
+        int ret;
+        while ((ret = av_read_frame(args->fmt_ctx, packet)) >= 0 &&
+               packet->stream_index != args->video_stream_index) {
+            av_packet_unref(packet);
+        }
+        if (ret < 0 || queue_push(&data->packets, &packet) < 0) {
+            recycle_packet(data, packet);
+            break;
+        }
+    }
+    
+    queue_close(&data->packets);
+    return NULL;
+}
+
+// Takes over a finished frame and moves every frame that is now in sequence
+// into the ring. The frames are collected under the mutex and pushed after
+// unlocking, so a full ring only blocks the converter doing the pushing; the
+// others keep filling the window. The draining flag keeps the ring
+// single-producer and in order: a converter that finds another one draining
+// leaves its frame in the window, and the drainer picks it up on its next pass.
+static void release_in_order(ThreadData *data, long seq, PoolFrame *frame) {
+    PoolFrame *ready[REORDER_WINDOW];
+    
+    pthread_mutex_lock(&data->reorder_mutex);
+    data->reorder[seq % REORDER_WINDOW] = frame;
+    if (data->draining) {
+        pthread_mutex_unlock(&data->reorder_mutex);
+        return;
+    }
+    data->draining = 1;
+    for (;;) {
+        int count = 0;
+        while (data->reorder[data->next_seq % REORDER_WINDOW]) {
+            int index = data->next_seq % REORDER_WINDOW;
+            ready[count++] = data->reorder[index];
+            data->reorder[index] = NULL;
+            data->next_seq++;
+        }
+        if (count == 0) {
+            break;
+        }
+        pthread_mutex_unlock(&data->reorder_mutex);
+        for (int i = 0; i < count; i++) {
+            add_frame_to_buffer(data, ready[i]);
+        }
+        pthread_mutex_lock(&data->reorder_mutex);
+    }
+    data->draining = 0;
+    pthread_mutex_unlock(&data->reorder_mutex);
+}
+
+// Output size for a src_width x src_height frame: in fit mode the largest
+// size with the source's aspect ratio that fits the picture widget (never
+// larger than the source), otherwise the source size. Kept even for the
+// chroma-subsampled paths in libswscale.
+static void output_size(ThreadData *data, int src_width, int src_height, int *width, int *height) {
+    int view_width = atomic_load(&data->view_width);
+    int view_height = atomic_load(&data->view_height);
+    double scale = 1.0;
+    if (data->fit_to_widget && view_width > 0 && view_height > 0) {
+        double scale_x = (double)view_width / src_width;
+        double scale_y = (double)view_height / src_height;
+        scale = scale_x < scale_y ? scale_x : scale_y;
+        if (scale > 1.0) {
+            scale = 1.0;
+        }
+    }
+    *width = ((int)(src_width * scale + 0.5) + 1) & ~1;
+    *height = ((int)(src_height * scale + 0.5) + 1) & ~1;
+    if (*width < 2) *width = 2;
+    if (*height < 2) *height = 2;
+    if (*width > src_width) *width = src_width;
+    if (*height > src_height) *height = src_height;
+}
+
+// One converter's scaling context and the geometry it was built for.
+typedef struct {
+    struct SwsContext *ctx;
+    int src_width, src_height, src_format;
+    int dst_width, dst_height;
+} Scaler;
+
+// (Re)builds the context when the source or the output size changed. The
+// context splits each conversion into horizontal slices over
+// data->slice_threads libswscale worker threads.
+static int scaler_prepare(ThreadData *data, Scaler *scaler, const AVFrame *src, int width, int height) {
+    if (scaler->ctx && scaler->src_width == src->width && scaler->src_height == src->height &&
+        scaler->src_format == src->format && scaler->dst_width == width && scaler->dst_height == height) {
+        return 0;
+    }
+    sws_freeContext(scaler->ctx);
+    scaler->ctx = sws_alloc_context();
+    if (!scaler->ctx) {
+        return -1;
+    }
+    av_opt_set_int(scaler->ctx, "srcw", src->width, 0);
+    av_opt_set_int(scaler->ctx, "srch", src->height, 0);
+    av_opt_set_int(scaler->ctx, "src_format", src->format, 0);
+    av_opt_set_int(scaler->ctx, "dstw", width, 0);
+    av_opt_set_int(scaler->ctx, "dsth", height, 0);
+    av_opt_set_int(scaler->ctx, "dst_format", OUTPUT_FORMAT, 0);
+    av_opt_set_int(scaler->ctx, "sws_flags", width < src->width ? SWS_AREA : SWS_BILINEAR, 0);
+    av_opt_set_int(scaler->ctx, "threads", data->slice_threads, 0);
+    if (sws_init_context(scaler->ctx, NULL, NULL) < 0) {
+        sws_freeContext(scaler->ctx);
+        scaler->ctx = NULL;
+        return -1;
+    }
+    scaler->src_width = src->width;
+    scaler->src_height = src->height;
+    scaler->src_format = src->format;
+    scaler->dst_width = width;
+    scaler->dst_height = height;
+    return 0;
+}
+
+// Gives a pool frame a width x height buffer. Only happens after a resize;
+// otherwise the frame keeps its buffer.
+static int resize_pool_frame(AVFrame *out, int width, int height) {
+    if (out->width == width && out->height == height && out->data[0]) {
+        return 0;
+    }
+    av_frame_unref(out);
+    out->format = OUTPUT_FORMAT;
+    out->width = width;
+    out->height = height;
+    return av_frame_get_buffer(out, 0);
+}
+
+static void *convert_thread(void *arg) {
+    ThreadData *data = (ThreadData *)arg;
+    Scaler scaler = { 0 };
+    DecodedFrame decoded;
+    
+    for (;;) {
+        // NULL once the pool is closing; the queue is then only drained
+        PoolFrame *rgb_frame = frame_pool_acquire(&data->pool);
+        if (!queue_pop(&data->decoded, &decoded)) {
+            if (rgb_frame) {
+                frame_pool_unref(rgb_frame);
+            }
+            break;
+        }
+        AVFrame *frame = decoded.frame;
+        if (rgb_frame && data->terminate) {
+            frame_pool_unref(rgb_frame);
+        } else if (rgb_frame) {
+            AVFrame *out = rgb_frame->frame;
+            int width, height;
+            output_size(data, frame->width, frame->height, &width, &height);
+            // A failed conversion leaves the frame without data so the
+            // display skips it instead of showing the buffer's previous pixels
+            if (resize_pool_frame(out, width, height) < 0) {
+                fprintf(stderr, "Could not allocate RGB frame data\n");
+                av_frame_unref(out);
+            } else if (scaler_prepare(data, &scaler, frame, width, height) < 0) {
+                fprintf(stderr, "Could not initialize the conversion context\n");
+                av_frame_unref(out);
+            } else if (sws_scale_frame(scaler.ctx, out, frame) < 0) {
+                fprintf(stderr, "Could not convert frame\n");
+                av_frame_unref(out);
+            }
+            rgb_frame->pts = decoded.pts;
+            // Even a failed conversion fills its sequence number so later frames can pass
+            release_in_order(data, decoded.seq, rgb_frame);
+        }
+        recycle_frame(data, frame);
+    }
+    
+    sws_freeContext(scaler.ctx);
+    return NULL;
+}
+
+// Drains the decoder into data->decoded. Returns -1 on a decoding error or
+// once the pipeline is shutting down.
+static int receive_frames(ThreadData *data, AVCodecContext *codec_ctx, FrameTiming *timing) {
+    for (;;) {
+        AVFrame *frame;
+        if (!queue_pop(&data->free_frames, &frame)) {
+            return -1;
+        }
+        int ret = avcodec_receive_frame(codec_ctx, frame);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+            recycle_frame(data, frame);
+            return 0;
+        } else if (ret < 0) {
+            fprintf(stderr, "Error receiving frame\n");
+            recycle_frame(data, frame);
+            return -1;
+        }
+        
+        int64_t timestamp = frame->best_effort_timestamp;
+        timing->pts = timestamp != AV_NOPTS_VALUE ? (timestamp - timing->start_pts) * timing->time_base
+                                                  : timing->pts + timing->frame_duration;
+        
+        // Skip the conversion of frames the display could only throw away
+        if (timing->consecutive_drops < MAX_CONSECUTIVE_DROPS &&
+            frame_is_late(data, timing->pts, timing->frame_duration)) {
+            atomic_fetch_add(&data->frames_dropped, 1);
+            timing->consecutive_drops++;
+            recycle_frame(data, frame);
+            continue;
+        }
+        timing->consecutive_drops = 0;
+        
+        DecodedFrame decoded = { frame, timing->pts, timing->next_seq++ };
+        if (queue_push(&data->decoded, &decoded) < 0) {
+            recycle_frame(data, frame);
+            return -1;
+        }
+    }
+}
+
+// Decoding thread function. It opens the input, runs the decode stage and
+// owns the other stages' threads. Everything runs as fast as the ring
+// drains; the display's tick callback does all the pacing.
 static void *decode_thread(void *arg) {
     ThreadData *data = (ThreadData *)arg;
     
     AVFormatContext *fmt_ctx = NULL;
     AVCodecContext *codec_ctx = NULL;
     AVPacket *packet = NULL;
-    AVFrame *frame = NULL;
-    AVFrame *rgb_frame = NULL;
-    struct SwsContext *sws_ctx = NULL;
+    AVPacket *packet_shells[PACKET_SHELLS] = { 0 };
+    AVFrame *frame_shells[FRAME_SHELLS] = { 0 };
     int video_stream_index = -1;
+    pthread_t demux_id;
+    pthread_t convert_ids[MAX_CONVERT_WORKERS];
+    int demux_started = 0;
+    int converters = 0;
     
     // Open input file
     if (avformat_open_input(&fmt_ctx, data->filename, NULL, NULL) < 0) {
@@ -130,7 +671,8 @@ static void *decode_thread(void *arg) {
     }
     
     // Get codec context
-    AVCodecParameters *codecpar = fmt_ctx->streams[video_stream_index]->codecpar;
+    AVStream *stream = fmt_ctx->streams[video_stream_index];
+    AVCodecParameters *codecpar = stream->codecpar;
     const AVCodec *codec = avcodec_find_decoder(codecpar->codec_id);
     if (!codec) {
         fprintf(stderr, "Codec not found\n");
@@ -148,142 +690,221 @@ static void *decode_thread(void *arg) {
         goto cleanup;
     }
     
+    // Frame threading decodes several frames at once, slice threading splits
+    // one frame; the codec uses whichever it supports. 0 = one thread per core.
+    codec_ctx->thread_count = data->decode_threads;
+    codec_ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    codec_ctx->pkt_timebase = stream->time_base;
+    
     if (avcodec_open2(codec_ctx, codec, NULL) < 0) {
         fprintf(stderr, "Could not open codec\n");
         goto cleanup;
     }
     
-    // Allocate frame and packet
-    packet = av_packet_alloc();
-    frame = av_frame_alloc();
-    rgb_frame = av_frame_alloc();
-    
-    if (!packet || !frame || !rgb_frame) {
-        fprintf(stderr, "Could not allocate frames or packet\n");
+    // Preallocate the RGB frames: one more per converter that can be busy
+    // or waiting to be reordered
+    int width, height;
+    output_size(data, codecpar->width, codecpar->height, &width, &height);
+    if (frame_pool_alloc(&data->pool, FRAME_POOL_BASE + data->convert_workers,
+                         width, height, OUTPUT_FORMAT) < 0) {
+        fprintf(stderr, "Could not allocate RGB frame data\n");
         goto cleanup;
     }
     
-    // Prepare RGB frame
-    rgb_frame->format = AV_PIX_FMT_RGB24;
-    rgb_frame->width = codecpar->width;
-    rgb_frame->height = codecpar->height;
+    // Preallocate the shells the stages pass packets and decoded frames in
+    for (int i = 0; i < PACKET_SHELLS; i++) {
+        packet_shells[i] = av_packet_alloc();
+        if (!packet_shells[i] || queue_push(&data->free_packets, &packet_shells[i]) < 0) {
+            fprintf(stderr, "Could not allocate packets\n");
+            goto cleanup;
+        }
+    }
+    for (int i = 0; i < FRAME_SHELLS; i++) {
+        frame_shells[i] = av_frame_alloc();
+        if (!frame_shells[i] || queue_push(&data->free_frames, &frame_shells[i]) < 0) {
+            fprintf(stderr, "Could not allocate frames\n");
+            goto cleanup;
+        }
+    }
     
-    if (av_frame_get_buffer(rgb_frame, 0) < 0) {
-        fprintf(stderr, "Could not allocate RGB frame data\n");
+    // Timestamps are taken relative to the stream start. Frames without one
+    // follow the previous frame by one frame duration.
+    AVRational rate = av_guess_frame_rate(fmt_ctx, stream, NULL);
+    FrameTiming timing = { 0 };
+    timing.time_base = av_q2d(stream->time_base);
+    timing.start_pts = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+    timing.frame_duration = rate.num > 0 && rate.den > 0 ? (double)rate.den / rate.num : 1.0 / data->frame_rate;
+    timing.pts = -timing.frame_duration;
+    
+    // Start the demux and conversion stages
+    DemuxArgs demux_args = { data, fmt_ctx, video_stream_index };
+    if (pthread_create(&demux_id, NULL, demux_thread, &demux_args) != 0) {
+        fprintf(stderr, "Failed to create demux thread\n");
+        goto cleanup;
+    }
+    demux_started = 1;
+    for (; converters < data->convert_workers; converters++) {
+        if (pthread_create(&convert_ids[converters], NULL, convert_thread, data) != 0) {
+            fprintf(stderr, "Failed to create conversion thread\n");
+            break;
+        }
+    }
+    if (converters == 0) {
         goto cleanup;
     }
     
-    // Read frames and send them to the buffer
-    while (av_read_frame(fmt_ctx, packet) >= 0 && !data->terminate) {
-        if (packet->stream_index == video_stream_index) {
-            int ret = avcodec_send_packet(codec_ctx, packet);
-            if (ret < 0) {
+    // Decode packets until the demuxer runs dry, then flush the decoder
+    while (queue_pop(&data->packets, &packet)) {
+        int ret = data->terminate ? -1 : avcodec_send_packet(codec_ctx, packet);
+        recycle_packet(data, packet);
+        if (ret < 0) {
+            if (!data->terminate) {
                 fprintf(stderr, "Error sending packet for decoding\n");
-                break;
-            }
-            
-            while (ret >= 0 && !data->terminate) {
-                ret = avcodec_receive_frame(codec_ctx, frame);
-                if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-                    break;
-                } else if (ret < 0) {
-                    fprintf(stderr, "Error receiving frame\n");
-                    goto cleanup;
-                }
-                
-                // Convert to RGB24
-                if (!sws_ctx) {
-                    sws_ctx = sws_getContext(
-                        frame->width, frame->height, (enum AVPixelFormat)frame->format,
-                        frame->width, frame->height, AV_PIX_FMT_RGB24,
-                        SWS_BILINEAR, NULL, NULL, NULL);
-                    
-                    if (!sws_ctx) {
-                        fprintf(stderr, "Could not initialize the conversion context\n");
-                        goto cleanup;
-                    }
-                }
-                
-                sws_scale(sws_ctx, (const uint8_t * const*)frame->data, frame->linesize,
-                         0, frame->height, rgb_frame->data, rgb_frame->linesize);
-                
-                // Add frame to buffer
-                add_frame_to_buffer(data, rgb_frame);
-                
-                // Slow down the decoding to match the desired frame rate
-                usleep((1.0 / data->frame_rate) * 1000000);
             }
+            break;
         }
-        av_packet_unref(packet);
+        if (receive_frames(data, codec_ctx, &timing) < 0) {
+            break;
+        }
+    }
+    if (!data->terminate && avcodec_send_packet(codec_ctx, NULL) >= 0) {
+        receive_frames(data, codec_ctx, &timing);
     }
     
 cleanup:
-    av_frame_free(&frame);
-    av_frame_free(&rgb_frame);
-    av_packet_free(&packet);
+    // Unblock and wait for the other stages. Once they are gone every shell,
+    // wherever it was left, is freed with whatever it still references.
+    queue_close(&data->packets);
+    queue_close(&data->decoded);
+    queue_close(&data->free_packets);
+    queue_close(&data->free_frames);
+    if (demux_started) {
+        pthread_join(demux_id, NULL);
+    }
+    for (int i = 0; i < converters; i++) {
+        pthread_join(convert_ids[i], NULL);
+    }
+    for (int i = 0; i < PACKET_SHELLS; i++) {
+        av_packet_free(&packet_shells[i]);
+    }
+    for (int i = 0; i < FRAME_SHELLS; i++) {
+        av_frame_free(&frame_shells[i]);
+    }
+    
     avcodec_free_context(&codec_ctx);
     avformat_close_input(&fmt_ctx);
-    sws_freeContext(sws_ctx);
     
     return NULL;
 }
 
-// Timer function for updating the display
-static gboolean update_display(gpointer user_data) {
-    ThreadData *data = (ThreadData *)user_data;
-    
-    AVFrame *frame = get_frame_from_buffer(data);
-    if (frame) {
-        GdkPixbuf *pixbuf = gdk_pixbuf_new_from_data(
-            frame->data[0],
-            GDK_COLORSPACE_RGB,
-            FALSE,
-            8,
-            frame->width,
-            frame->height,
-            frame->linesize[0],
-            NULL,
-            NULL);
-            
-        if (pixbuf) {
-            gtk_picture_set_pixbuf(GTK_PICTURE(frame_display), pixbuf);
-            g_object_unref(pixbuf);
-        }
-        av_frame_free(&frame);
+// Shows a frame and gives up the caller's reference. The texture borrows the
+// pool frame's pixels and hands the reference back through
+// release_texture_frame once GTK has dropped it.
+static void present_frame(ThreadData *data, PoolFrame *slot) {
+    AVFrame *frame = slot->frame;
+    if (!frame->data[0]) {
+        frame_pool_unref(slot);
+        return;
     }
     
+    GBytes *bytes = g_bytes_new_with_free_func(
+        frame->data[0],
+        (size_t)frame->linesize[0] * frame->height,
+        release_texture_frame,
+        slot);
+    GdkTexture *texture = gdk_memory_texture_new(
+        frame->width,
+        frame->height,
+        OUTPUT_MEMORY_FORMAT,
+        bytes,
+        frame->linesize[0]);
+    g_bytes_unref(bytes);
+    
+    gtk_picture_set_paintable(GTK_PICTURE(frame_display), GDK_PAINTABLE(texture));
+    g_object_unref(texture);
+    data->frames_presented++;
+}
+
+// Frame clock tick: shows the newest frame that is due by this frame's
+// presentation time. Due frames queued behind it were overtaken and are
+// counted as late; frames not yet due stay queued for a later tick.
+static gboolean on_frame_tick(GtkWidget *widget, GdkFrameClock *frame_clock, gpointer user_data) {
+    ThreadData *data = (ThreadData *)user_data;
+    
     // Check if we should continue
     if (data->terminate) {
-        timer_id = 0;
+        tick_id = 0;
         return G_SOURCE_REMOVE;
     }
     
+    // Tell the converters the size the picture will be drawn at
+    int scale = gtk_widget_get_scale_factor(widget);
+    atomic_store(&data->view_width, gtk_widget_get_width(widget) * scale);
+    atomic_store(&data->view_height, gtk_widget_get_height(widget) * scale);
+    
+    gint64 now = gdk_frame_clock_get_frame_time(frame_clock);
+    PoolFrame *due = NULL;
+    PoolFrame *next;
+    while ((next = peek_frame_from_buffer(data)) != NULL) {
+        int64_t base = atomic_load(&data->clock_base_us);
+        if (base == 0) {
+            // Start the clock so the first frame is due now
+            base = now - (int64_t)(next->pts * 1e6);
+            atomic_store(&data->clock_base_us, base);
+        }
+        if (base + (int64_t)(next->pts * 1e6) > now) {
+            break;
+        }
+        get_frame_from_buffer(data);
+        if (due) {
+            frame_pool_unref(due);
+            data->frames_late++;
+        }
+        due = next;
+    }
+    
+    if (due) {
+        present_frame(data, due);
+    }
     return G_SOURCE_CONTINUE;
 }
 
 // Clean up resources
 static void cleanup_resources() {
-    if (timer_id > 0) {
-        g_source_remove(timer_id);
-        timer_id = 0;
+    if (tick_id > 0) {
+        gtk_widget_remove_tick_callback(frame_display, tick_id);
+        tick_id = 0;
     }
     
-    pthread_mutex_lock(&thread_data.mutex);
-    thread_data.terminate = 1;
-    pthread_cond_signal(&thread_data.not_full);
-    pthread_cond_signal(&thread_data.not_empty);
-    pthread_mutex_unlock(&thread_data.mutex);
+    atomic_store(&thread_data.terminate, 1);
+    wake_producer(&thread_data.ring);
+    queue_close(&thread_data.packets);
+    queue_close(&thread_data.decoded);
+    // Wakes converters waiting for a pool frame; frames still in flight are
+    // freed by their last unref from here on
+    frame_pool_close(&thread_data.pool);
+    
+    // Wait for the pipeline to stop; the decode thread joins the demux thread
+    // and the converters, so nothing writes the ring after this
+    if (thread_data.decode_started) {
+        pthread_join(thread_data.decode_id, NULL);
+        thread_data.decode_started = 0;
+    }
     
-    // Clean up the frame buffer
-    for (int i = 0; i < BUFFER_SIZE; i++) {
-        if (thread_data.buffer[i].frame) {
-            av_frame_free(&thread_data.buffer[i].frame);
+    // Return the queued frames and whatever was left waiting for reordering
+    PoolFrame *frame;
+    while ((frame = get_frame_from_buffer(&thread_data)) != NULL) {
+        frame_pool_unref(frame);
+    }
+    for (int i = 0; i < REORDER_WINDOW; i++) {
+        if (thread_data.reorder[i]) {
+            frame_pool_unref(thread_data.reorder[i]);
+            thread_data.reorder[i] = NULL;
         }
     }
     
-    pthread_mutex_destroy(&thread_data.mutex);
-    pthread_cond_destroy(&thread_data.not_full);
-    pthread_cond_destroy(&thread_data.not_empty);
+    fprintf(stderr, "Presented %ld frames, dropped %ld late frames before conversion, %ld late at display\n",
+            thread_data.frames_presented, atomic_load(&thread_data.frames_dropped), thread_data.frames_late);
     
     free(thread_data.filename);
 }
@@ -304,6 +925,10 @@ static void activate(GtkApplication *app, gpointer user_data) {
     frame_display = gtk_picture_new();
     gtk_picture_set_can_shrink(GTK_PICTURE(frame_display), TRUE);
     gtk_picture_set_keep_aspect_ratio(GTK_PICTURE(frame_display), TRUE);
+    // Fill the window rather than follow the frame size, which in fit mode
+    // follows the widget size in turn
+    gtk_widget_set_hexpand(frame_display, TRUE);
+    gtk_widget_set_vexpand(frame_display, TRUE);
     
     // Create a box to hold the frame display
     GtkWidget *box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
@@ -315,24 +940,24 @@ static void activate(GtkApplication *app, gpointer user_data) {
     // Connect window close signal
     g_signal_connect(window, "close-request", G_CALLBACK(on_window_close), NULL);
     
-    // Start the decoding thread
-    pthread_t decode_thread_id;
-    if (pthread_create(&decode_thread_id, NULL, decode_thread, data) != 0) {
+    // Start the decoding thread; cleanup_resources joins it
+    if (pthread_create(&data->decode_id, NULL, decode_thread, data) != 0) {
         fprintf(stderr, "Failed to create decoding thread\n");
         return;
     }
-    pthread_detach(decode_thread_id);
+    data->decode_started = 1;
     
-    // Start the display timer
-    timer_id = g_timeout_add((guint)(1000.0 / data->frame_rate), update_display, data);
+    // Present frames from the widget's frame clock
+    tick_id = gtk_widget_add_tick_callback(frame_display, on_frame_tick, data, NULL);
     
     // Show the window
     gtk_widget_show(window);
 }
 
 int main(int argc, char **argv) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <video_file> <frame_rate>\n", argv[0]);
+    if (argc < 3 || argc > 6) {
+        fprintf(stderr, "Usage: %s <video_file> <frame_rate> [decode_threads] [convert_workers] [fit|full]\n",
+                argv[0]);
         return 1;
     }
     
@@ -343,15 +968,45 @@ int main(int argc, char **argv) {
         return 1;
     }
     
+    // Parse thread counts
+    int decode_threads = argc > 3 ? atoi(argv[3]) : 0;
+    int convert_workers = argc > 4 ? atoi(argv[4]) : DEFAULT_CONVERT_WORKERS;
+    if (decode_threads < 0 || convert_workers < 1 || convert_workers > MAX_CONVERT_WORKERS) {
+        fprintf(stderr, "Invalid thread count. Decode threads must be >= 0 (0 = auto), "
+                "convert workers 1-%d.\n", MAX_CONVERT_WORKERS);
+        return 1;
+    }
+    
+    // Parse conversion size: fit = the window's size (default), full = source size
+    const char *size_mode = argc > 5 ? argv[5] : "fit";
+    if (strcmp(size_mode, "fit") != 0 && strcmp(size_mode, "full") != 0) {
+        fprintf(stderr, "Invalid conversion size '%s'. Must be fit or full.\n", size_mode);
+        return 1;
+    }
+    
     // Initialize thread data
     memset(&thread_data, 0, sizeof(ThreadData));
     thread_data.frame_rate = frame_rate;
     thread_data.filename = strdup(argv[1]);
+    thread_data.decode_threads = decode_threads;
+    thread_data.convert_workers = convert_workers;
+    thread_data.fit_to_widget = strcmp(size_mode, "fit") == 0;
+    // Share the cores left after one per frame-level converter
+    thread_data.slice_threads = av_cpu_count() / convert_workers;
+    if (thread_data.slice_threads < 1) {
+        thread_data.slice_threads = 1;
+    }
     
-    // Initialize mutex and condition variables
-    pthread_mutex_init(&thread_data.mutex, NULL);
-    pthread_cond_init(&thread_data.not_full, NULL);
-    pthread_cond_init(&thread_data.not_empty, NULL);
+    // Initialize the frame pool and the pipeline queues
+    frame_pool_init(&thread_data.pool);
+    pthread_mutex_init(&thread_data.reorder_mutex, NULL);
+    if (queue_init(&thread_data.packets, PACKET_QUEUE_SIZE, sizeof(AVPacket *)) < 0 ||
+        queue_init(&thread_data.decoded, DECODED_QUEUE_SIZE, sizeof(DecodedFrame)) < 0 ||
+        queue_init(&thread_data.free_packets, PACKET_SHELLS, sizeof(AVPacket *)) < 0 ||
+        queue_init(&thread_data.free_frames, FRAME_SHELLS, sizeof(AVFrame *)) < 0) {
+        fprintf(stderr, "Could not allocate pipeline queues\n");
+        return 1;
+    }
     
     // Create and run the application
     GtkApplication *app = gtk_application_new("com.example.videoplayer", G_APPLICATION_FLAGS_NONE);
@@ -1,3 +1,3 @@
-g++ -o A3 A3.cpp `pkg-config --cflags --libs gtk4` -lm
+g++ -O2 -o A3 A3.cpp `pkg-config --cflags --libs gtk4` -pthread -lm -lrt
 
 ./A3
@@ -0,0 +1,233 @@
+// Dimension-generic k-means core shared by A3.
+//
+// Point<D, T> / Centroid<D, T> are the element types; the 2-D instantiation
+// keeps the x/y members the visualizer uses. Bulk data is held as planar
+// columns (all of dimension 0, then all of dimension 1, ...), the same layout
+// as the binary point file, so a mapped file can be clustered in place. With a
+// compile-time D the per-dimension loops unroll and the per-point loops
+// vectorise; D == Dynamic takes the dimension at run time instead.
+//
+// Everything here is GTK-free and thread-agnostic: the *_range functions work
+// on [begin, end) so the caller decides how to split the points, and iterate()
+// runs its chunks on whatever scheduler the caller passes in.
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+namespace kmeans {
+
+constexpr size_t Dynamic = 0;
+
+template <size_t D, typename T>
+struct Point {
+    std::array<T, D> coords{};
+    int cluster = -1;
+
+    T& operator[](size_t d) { return coords[d]; }
+    const T& operator[](size_t d) const { return coords[d]; }
+};
+
+template <typename T>
+struct Point<2, T> {
+    T x, y;
+    int cluster = -1;
+
+    T& operator[](size_t d) { return d == 0 ? x : y; }
+    const T& operator[](size_t d) const { return d == 0 ? x : y; }
+};
+
+template <size_t D, typename T>
+struct Centroid {
+    std::array<T, D> coords{};
+
+    T& operator[](size_t d) { return coords[d]; }
+    const T& operator[](size_t d) const { return coords[d]; }
+};
+
+template <typename T>
+struct Centroid<2, T> {
+    T x, y;
+
+    T& operator[](size_t d) { return d == 0 ? x : y; }
+    const T& operator[](size_t d) const { return d == 0 ? x : y; }
+};
+
+// Read-only planar view: coordinate d of point i is base[d * count + i].
+template <size_t D, typename T>
+struct PlanarPoints {
+    const T* base = nullptr;
+    size_t count = 0;
+    size_t dim = D;
+
+    size_t dimension() const { return D != Dynamic ? D : dim; }
+    const T* column(size_t d) const { return base + d * count; }
+};
+
+// Centroids are stored row-major: centroid c is centroids[c * dim .. c * dim + dim).
+template <size_t D, typename T>
+struct Model {
+    size_t dim = D;
+    size_t k = 0;
+    std::vector<T> centroids;
+
+    size_t dimension() const { return D != Dynamic ? D : dim; }
+    T* centroid(size_t c) { return centroids.data() + c * dimension(); }
+    const T* centroid(size_t c) const { return centroids.data() + c * dimension(); }
+};
+
+// Per-cluster coordinate sums (always in double) and point counts.
+struct Sums {
+    std::vector<double> coords;
+    std::vector<int64_t> count;
+
+    void reset(size_t k, size_t dim) {
+        coords.assign(k * dim, 0.0);
+        count.assign(k, 0);
+    }
+
+    void merge(const Sums& other) {
+        for (size_t i = 0; i < coords.size(); ++i) coords[i] += other.coords[i];
+        for (size_t i = 0; i < count.size(); ++i) count[i] += other.count[i];
+    }
+};
+
+// Nearest centroid for points [begin, end). Points are processed in blocks;
+// for each centroid the squared distance of the whole block is built one
+// dimension at a time, so the inner loop runs over contiguous points. Ties go
+// to the lowest centroid index, as in the 2-D engine.
+template <size_t D, typename T>
+void assign_range(const PlanarPoints<D, T>& points, const Model<D, T>& model,
+                  size_t begin, size_t end, int* out) {
+    constexpr size_t BLOCK = 64;
+    const size_t dim = points.dimension();
+    T best[BLOCK];
+    T dist[BLOCK];
+    int best_index[BLOCK];
+
+    for (size_t start = begin; start < end; start += BLOCK) {
+        const size_t m = std::min(BLOCK, end - start);
+        std::fill(best, best + m, std::numeric_limits<T>::max());
+        std::fill(best_index, best_index + m, -1);
+
+        for (size_t c = 0; c < model.k; ++c) {
+            const T* centre = model.centroid(c);
+            std::fill(dist, dist + m, T(0));
+            for (size_t d = 0; d < (D != Dynamic ? D : dim); ++d) {
+                const T* column = points.column(d) + start;
+                const T value = centre[d];
+                for (size_t j = 0; j < m; ++j) {
+                    T diff = column[j] - value;
+                    dist[j] += diff * diff;
+                }
+            }
+            for (size_t j = 0; j < m; ++j) {
+                if (dist[j] < best[j]) {
+                    best[j] = dist[j];
+                    best_index[j] = (int)c;
+                }
+            }
+        }
+        std::copy(best_index, best_index + m, out + start);
+    }
+}
+
+template <size_t D, typename T>
+void accumulate_range(const PlanarPoints<D, T>& points, const int* labels,
+                      size_t begin, size_t end, Sums& sums) {
+    const size_t dim = points.dimension();
+    for (size_t i = begin; i < end; ++i) {
+        if (labels[i] >= 0) sums.count[labels[i]]++;
+    }
+    for (size_t d = 0; d < (D != Dynamic ? D : dim); ++d) {
+        const T* column = points.column(d);
+        for (size_t i = begin; i < end; ++i) {
+            if (labels[i] >= 0) sums.coords[(size_t)labels[i] * dim + d] += column[i];
+        }
+    }
+}
+
+// Moves every non-empty cluster's centroid to the mean of its points.
+template <size_t D, typename T>
+void update_centroids(Model<D, T>& model, const Sums& sums) {
+    const size_t dim = model.dimension();
+    for (size_t c = 0; c < model.k; ++c) {
+        if (sums.count[c] == 0) continue;
+        T* centre = model.centroid(c);
+        for (size_t d = 0; d < dim; ++d) {
+            centre[d] = (T)(sums.coords[c * dim + d] / sums.count[c]);
+        }
+    }
+}
+
+template <size_t D, typename T>
+double inertia_range(const PlanarPoints<D, T>& points, const Model<D, T>& model,
+                     const int* labels, size_t begin, size_t end) {
+    const size_t dim = points.dimension();
+    double total = 0.0;
+    for (size_t i = begin; i < end; ++i) {
+        if (labels[i] < 0) continue;
+        const T* centre = model.centroid(labels[i]);
+        double sum = 0.0;
+        for (size_t d = 0; d < (D != Dynamic ? D : dim); ++d) {
+            double diff = (double)points.column(d)[i] - centre[d];
+            sum += diff * diff;
+        }
+        total += sum;
+    }
+    return total;
+}
+
+// Buffers iterate() keeps between calls. labels holds the current assignment
+// (-1 before the first iteration); the rest is scratch.
+struct Workspace {
+    std::vector<int> labels;
+    std::vector<int> nearest;
+    std::vector<Sums> partial;
+    std::vector<char> changed;
+};
+
+// One Lloyd iteration over chunks of chunk_size points. run(num_chunks, task)
+// must call task(chunk) once per chunk, in any order and on any thread. Each
+// chunk assigns and sums its own points; the partial sums are merged in chunk
+// order, so the result does not depend on how the chunks were scheduled.
+// Returns true if any label changed.
+template <size_t D, typename T, typename Run>
+bool iterate(const PlanarPoints<D, T>& points, Model<D, T>& model, Workspace& work,
+             size_t chunk_size, Run&& run) {
+    const size_t n = points.count;
+    const size_t dim = model.dimension();
+    const size_t num_chunks = (n + chunk_size - 1) / chunk_size;
+    work.labels.resize(n, -1);
+    work.nearest.resize(n);
+    work.partial.resize(num_chunks);
+    work.changed.assign(num_chunks, 0);
+
+    run(num_chunks, [&](size_t chunk) {
+        const size_t begin = chunk * chunk_size;
+        const size_t end = std::min(n, begin + chunk_size);
+        assign_range(points, model, begin, end, work.nearest.data());
+        bool changed = false;
+        for (size_t i = begin; i < end; ++i) {
+            changed |= work.labels[i] != work.nearest[i];
+            work.labels[i] = work.nearest[i];
+        }
+        work.changed[chunk] = changed;
+        work.partial[chunk].reset(model.k, dim);
+        accumulate_range(points, work.labels.data(), begin, end, work.partial[chunk]);
+    });
+
+    if (num_chunks == 0) return false;
+    for (size_t chunk = 1; chunk < num_chunks; ++chunk) {
+        work.partial[0].merge(work.partial[chunk]);
+    }
+    update_centroids(model, work.partial[0]);
+    return std::find(work.changed.begin(), work.changed.end(), 1) != work.changed.end();
+}
+
+}  // namespace kmeans